@@ -0,0 +1,349 @@
+/*
+ * Dual Untrasonic HC-SR04 controller driver - userspace interface.
+ *
+ * Author:
+ *  Linh Nguyen (nvl1109@gmail.com)
+ *
+ */
+
+#ifndef _DUAL_HCSR04_H
+#define _DUAL_HCSR04_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Binary sample record
+ *
+ * read() of /dev/dual_hcsr04 returns whole records, as many as fit in the
+ * buffer. It blocks until a sample is there, or fails with EAGAIN if the file
+ * is non-blocking, and fails with EINVAL if not even one record fits. The
+ * text format ("<echo> <timestamp_ns> <distance_mm>" lines) is
+ * still available through DUAL_HCSR04_MODE_TEXT, e.g. for cat.
+ */
+#define DUAL_HCSR04_RECORD_VERSION  3
+
+#define DUAL_HCSR04_MODE_BINARY     0
+#define DUAL_HCSR04_MODE_TEXT       1
+#define DUAL_HCSR04_MODE_EDGES      2   /* struct dual_hcsr04_edge, see below */
+
+/* Record flags */
+#define DUAL_HCSR04_FLAG_TIMEOUT    (1 << 0)    /* no echo before the timeout */
+#define DUAL_HCSR04_FLAG_GLITCH     (1 << 1)    /* echo end without a start */
+#define DUAL_HCSR04_FLAG_OVERFLOW   (1 << 2)    /* samples dropped before this one */
+#define DUAL_HCSR04_FLAG_BUSY       (1 << 3)    /* with TIMEOUT: echo still high at the trigger */
+
+/* Most echo channels of a device */
+#define DUAL_HCSR04_MAX_CHANNELS    8
+
+/* Fractional bits of dual_hcsr04_record.distance */
+#define DUAL_HCSR04_DISTANCE_SHIFT  16
+
+/*
+ * struct dual_hcsr04_record - One distance sample
+ * @version: DUAL_HCSR04_RECORD_VERSION
+ * @channel: echo number, starting at 1
+ * @flags: DUAL_HCSR04_FLAG_*
+ * @width_ns: raw echo pulse width, 0 on timeout or glitch
+ * @timestamp_ns: monotonic time the echo ended or timed out
+ * @distance: distance in millimetres, fixed point with
+ *            DUAL_HCSR04_DISTANCE_SHIFT fractional bits, 0 if not measured
+ * @filtered: distance after the channel filter, same format as distance.
+ *            Equal to distance while the filter is off; on timeout or glitch
+ *            the last filter output, 0 before the first valid sample.
+ * @spread: burst mode, standard deviation of the distances of the single
+ *          pings, same format as distance. 0 outside burst mode.
+ * @pings: valid pings the distance is built from, 0 on timeout or glitch
+ * @reserved: zero
+ */
+struct dual_hcsr04_record {
+    __u8        version;
+    __u8        channel;
+    __u16       flags;
+    __u32       width_ns;
+    __u64       timestamp_ns;
+    __s32       distance;
+    __s32       filtered;
+    __u32       spread;
+    __u16       pings;
+    __u16       reserved;
+};
+
+/*
+ * ioctl() control plane
+ */
+#define DUAL_HCSR04_IOC_MAGIC       0xB7
+
+/*
+ * Free run: instead of waiting for the next sampling tick, each trigger group
+ * measures again as soon as all its echoes are back or timed out and
+ * recovery_us has passed. The rate then follows the measured distance; any
+ * non-zero rate runs, 0 stops.
+ */
+#define DUAL_HCSR04_CONFIG_FREE_RUN (1 << 0)
+
+/*
+ * Short range: the rate is only limited by the echo timeout derived from
+ * max_range_mm (and the groups), not by the default 50 samples/s. With
+ * max_range_mm of 1000 a single group can sample at about 150 samples/s.
+ */
+#define DUAL_HCSR04_CONFIG_SHORT_RANGE (1 << 1)
+
+/*
+ * Air compensation: convert echo widths with the speed of sound at
+ * temperature_mc and humidity_pct instead of the fixed 343 m/s. The speed of
+ * sound changes by about 0.18 %/degC, i.e. 7 % between 0 and 40 degC.
+ */
+#define DUAL_HCSR04_CONFIG_COMPENSATE (1 << 2)
+
+/*
+ * Micrometre text output: text mode lines give the distance in um instead of
+ * mm. Binary records always use mm with DUAL_HCSR04_DISTANCE_SHIFT
+ * fractional bits, which is finer than 1 um.
+ */
+#define DUAL_HCSR04_CONFIG_MICROMETRE (1 << 3)
+
+/*
+ * Channel filter: a sliding median over the last filter_window valid
+ * distances of each echo removes single spikes, followed by an exponential
+ * moving average with weight filter_alpha / 256 for the newest median. A
+ * window of 0 or 1 skips the median, an alpha of 0 skips the average.
+ */
+#define DUAL_HCSR04_FILTER_WINDOW_MAX   15      /* odd */
+#define DUAL_HCSR04_FILTER_ALPHA_ONE    256
+
+/*
+ * Burst mode: with a burst_count above 1, every sampling tick fires
+ * burst_count trigger cycles of each group back to back, recovery_us apart,
+ * and publishes one record per echo with the mean of the valid pings, or the
+ * median with DUAL_HCSR04_CONFIG_BURST_MEDIAN. The variance of a mean of
+ * pings samples is spread^2 / pings, 1 / pings of a single ping.
+ */
+#define DUAL_HCSR04_CONFIG_BURST_MEDIAN (1 << 4)
+#define DUAL_HCSR04_BURST_MAX       16
+
+/*
+ * Raw edge capture: the driver also records every trigger, echo edge and echo
+ * timeout as a struct dual_hcsr04_edge, for files in DUAL_HCSR04_MODE_EDGES.
+ * Costs a spinlock per edge, meant for field debugging.
+ */
+#define DUAL_HCSR04_CONFIG_CAPTURE  (1 << 5)
+
+/* Air parameter limits */
+#define DUAL_HCSR04_TEMPERATURE_MIN (-40000)    /* milli degC */
+#define DUAL_HCSR04_TEMPERATURE_MAX (85000)     /* milli degC */
+#define DUAL_HCSR04_HUMIDITY_MAX    (100)       /* % RH */
+
+/*
+ * struct dual_hcsr04_config - Measurement configuration, set atomically
+ * @rate: samples per second, 0 stops the measurement
+ * @max_range_mm: maximum measured range, echoes longer than this time out
+ * @quiet_gap_us: minimum time between the cycles of trigger groups that can
+ *                hear each other
+ * @flags: DUAL_HCSR04_CONFIG_*
+ * @recovery_us: free run only, time between the end of a cycle of a group and
+ *               its next trigger
+ * @temperature_mc: air temperature in milli degC, used with
+ *                  DUAL_HCSR04_CONFIG_COMPENSATE
+ * @humidity_pct: relative air humidity in %, used with
+ *                DUAL_HCSR04_CONFIG_COMPENSATE
+ * @filter_window: median window in samples, odd, 0 for no median
+ * @filter_alpha: moving average weight in 1/256, 0 for no average
+ * @burst_count: pings per published sample, 0 or 1 for no burst
+ * @reserved: zero
+ */
+struct dual_hcsr04_config {
+    __u32       rate;
+    __u32       max_range_mm;
+    __u32       quiet_gap_us;
+    __u32       flags;
+    __u32       recovery_us;
+    __s32       temperature_mc;
+    __u32       humidity_pct;
+    __u16       filter_window;
+    __u16       filter_alpha;
+    __u32       burst_count;
+    __u32       reserved[7];
+};
+
+/*
+ * Raw edge events
+ *
+ * With DUAL_HCSR04_CONFIG_CAPTURE set, read() of a file in
+ * DUAL_HCSR04_MODE_EDGES returns whole struct dual_hcsr04_edge in the order
+ * the driver saw them. Edges are taken in the echo IRQ handler, before any
+ * conversion, so a capture can be replayed through the conversion, filter and
+ * burst code, see dual_hcsr04_replay.
+ */
+#define DUAL_HCSR04_EDGE_TRIGGER    0   /* trigger pulse, index is the group from 0 */
+#define DUAL_HCSR04_EDGE_RISING     1   /* echo start, index is the echo from 1 */
+#define DUAL_HCSR04_EDGE_FALLING    2   /* echo end, index is the echo from 1 */
+#define DUAL_HCSR04_EDGE_TIMEOUT    3   /* echo timed out, index is the echo from 1 */
+#define DUAL_HCSR04_EDGE_BUSY       4   /* echo still high at the trigger, index is the echo from 1 */
+
+/* Edge flags */
+#define DUAL_HCSR04_EDGE_FLAG_OVERFLOW (1 << 0)    /* edges dropped before this one */
+
+/*
+ * struct dual_hcsr04_edge - One raw event
+ * @timestamp_ns: monotonic time of the event
+ * @type: DUAL_HCSR04_EDGE_*
+ * @index: trigger group or echo number, see the event types
+ * @flags: DUAL_HCSR04_EDGE_FLAG_*
+ * @reserved: zero
+ */
+struct dual_hcsr04_edge {
+    __u64       timestamp_ns;
+    __u8        type;
+    __u8        index;
+    __u16       flags;
+    __u32       reserved;
+};
+
+/*
+ * Capture log file, written by dual_hcsr04_capture: a struct
+ * dual_hcsr04_capture_header followed by struct dual_hcsr04_edge until the
+ * end of the file, in host byte order.
+ */
+#define DUAL_HCSR04_CAPTURE_MAGIC   0x50414348  /* "HCAP" */
+#define DUAL_HCSR04_CAPTURE_VERSION 1
+
+/*
+ * struct dual_hcsr04_capture_header - Capture log file header
+ * @magic: DUAL_HCSR04_CAPTURE_MAGIC
+ * @version: DUAL_HCSR04_CAPTURE_VERSION
+ * @channels: number of echo channels
+ * @reserved: zero
+ * @echo_groups: trigger group of echo N + 1
+ * @config: configuration at the start of the capture
+ */
+struct dual_hcsr04_capture_header {
+    __u32       magic;
+    __u32       version;
+    __u32       channels;
+    __u32       reserved;
+    __u8        echo_groups[DUAL_HCSR04_MAX_CHANNELS];
+    struct dual_hcsr04_config config;
+};
+
+/*
+ * struct dual_hcsr04_counters - Driver counters since load
+ * @engine_wakeups: measurement engine wakeups
+ * @sched_overruns: sampling ticks missed
+ * @sched_jitter_max_ns: worst sampling tick jitter
+ * @samples: samples published
+ * @overflows: samples dropped on full sample rings, counted only while a file
+ *             that has not mapped the shared ring is open
+ * @timeouts: echoes that timed out
+ * @glitches: echoes that ended without a start
+ */
+struct dual_hcsr04_counters {
+    __u64       engine_wakeups;
+    __u64       sched_overruns;
+    __u64       sched_jitter_max_ns;
+    __u64       samples;
+    __u64       overflows;
+    __u64       timeouts;
+    __u64       glitches;
+};
+
+/*
+ * struct dual_hcsr04_read - Fetch up to count records in one call
+ * @records: user pointer to an array of struct dual_hcsr04_record, 64 bits
+ *           wide so 32 bit programs on a 64 bit kernel pass the same struct
+ * @count: size of the array
+ * @filled: records written, set by the driver
+ */
+struct dual_hcsr04_read {
+    __u64       records;
+    __u32       count;
+    __u32       filled;
+};
+
+/*
+ * struct dual_hcsr04_latest - Last sample of every echo, without consuming
+ * any ring. Echoes without a sample yet have a zero record.
+ * @channels: number of echo channels, records beyond it are zero
+ * @reserved: zero
+ * @records: last sample of echo N + 1
+ */
+struct dual_hcsr04_latest {
+    __u32       channels;
+    __u32       reserved;
+    struct dual_hcsr04_record records[DUAL_HCSR04_MAX_CHANNELS];
+};
+
+#define DUAL_HCSR04_IOC_GET_CONFIG      _IOR(DUAL_HCSR04_IOC_MAGIC, 1, struct dual_hcsr04_config)
+#define DUAL_HCSR04_IOC_SET_CONFIG      _IOW(DUAL_HCSR04_IOC_MAGIC, 2, struct dual_hcsr04_config)
+#define DUAL_HCSR04_IOC_SET_MODE        _IOW(DUAL_HCSR04_IOC_MAGIC, 3, __u32)
+#define DUAL_HCSR04_IOC_GET_COUNTERS    _IOR(DUAL_HCSR04_IOC_MAGIC, 4, struct dual_hcsr04_counters)
+#define DUAL_HCSR04_IOC_READ            _IOWR(DUAL_HCSR04_IOC_MAGIC, 5, struct dual_hcsr04_read)
+#define DUAL_HCSR04_IOC_GET_LATEST      _IOR(DUAL_HCSR04_IOC_MAGIC, 6, struct dual_hcsr04_latest)
+#define DUAL_HCSR04_IOC_SET_CURSOR      _IOW(DUAL_HCSR04_IOC_MAGIC, 7, __u32)
+
+/*
+ * mmap() of /dev/dual_hcsr04
+ *
+ * The mapping is read only. The first page holds struct
+ * dual_hcsr04_mmap_header, the struct dual_hcsr04_record slots start at
+ * data_offset. The driver is the only producer and never waits for consumers:
+ * it writes slot (head % ring_size) and then increments head. Every consumer
+ * keeps its own cursor, so any number of processes can map the ring at the
+ * same time.
+ *
+ * Once a file has mapped the ring, poll() on it follows the ring instead of
+ * the read() rings: it reports POLLIN while head differs from the cursor of
+ * the file. mmap() sets that cursor to head, and the consumer passes its own
+ * cursor with DUAL_HCSR04_IOC_SET_CURSOR once it has read up to head, before
+ * it polls again. poll() itself never moves the cursor, so it is level
+ * triggered like any other file; threads sharing the file share the cursor.
+ * Such a file no longer reads the read() rings, and their overflows are not
+ * counted while only mapped files are open.
+ *
+ * To read, a consumer copies slot (cursor % ring_size) when cursor != head,
+ * then re-reads head; if (head - cursor) >= ring_size the slot may have been
+ * overwritten while it was copied and the consumer has fallen behind.
+ *
+ * The header also holds the last sample of every echo, for consumers that
+ * only poll the current distance. Each one is guarded by a sequence count:
+ * read seq, retry while it is odd, copy the record, then retry if seq has
+ * changed meanwhile. The driver never waits for readers.
+ */
+#define DUAL_HCSR04_MMAP_MAGIC      0x48435352  /* "HCSR" */
+#define DUAL_HCSR04_MMAP_VERSION    4
+
+/*
+ * struct dual_hcsr04_latest_slot - Last sample of one echo
+ * @seq: odd while the driver updates record
+ * @reserved: zero
+ * @record: last sample
+ */
+struct dual_hcsr04_latest_slot {
+    __u32       seq;
+    __u32       reserved;
+    struct dual_hcsr04_record record;
+};
+
+/*
+ * struct dual_hcsr04_mmap_header - Shared ring header
+ * @magic: DUAL_HCSR04_MMAP_MAGIC
+ * @version: DUAL_HCSR04_MMAP_VERSION
+ * @ring_size: number of sample slots, a power of 2
+ * @data_offset: offset of the first slot from the start of the mapping
+ * @head: free running count of samples written, wraps at 2^32
+ * @channels: number of echo channels, entries of latest in use
+ * @reserved: zero
+ * @latest: last sample of echo N + 1
+ */
+struct dual_hcsr04_mmap_header {
+    __u32       magic;
+    __u32       version;
+    __u32       ring_size;
+    __u32       data_offset;
+    __u32       head;
+    __u32       channels;
+    __u32       reserved[2];
+    struct dual_hcsr04_latest_slot latest[DUAL_HCSR04_MAX_CHANNELS];
+};
+
+#endif /* _DUAL_HCSR04_H */
@@ -0,0 +1,304 @@
+/*
+ * End to end benchmark of the dual HC-SR04 driver, e.g. against
+ * dual_hcsr04_sim.
+ *
+ * For every requested rate it configures the driver, reads records for a
+ * while and reports the achieved sample rate, the latency from the end of
+ * the echo (record timestamp) to userspace, the jitter of the sample period
+ * of echo 1, the CPU time and wakeups per second of the measurement thread
+ * and, given the simulated distances, the distance error.
+ *
+ * With -i it reads the records of another engine from a file or pipe
+ * instead, e.g. dual_hcsr04_gpiod, which runs at its own rate.
+ *
+ * Author:
+ *  Linh Nguyen (nvl1109@gmail.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/ioctl.h>
+
+#include "dual_hcsr04.h"
+
+#define DEVICE_PATH     "/dev/dual_hcsr04"
+#define MAX_RATE_PATH   "/sys/module/gpiomod_dual_hcsr04/parameters/max_rate"
+#define ENGINE_COMM     "distance"
+#define MAX_LATENCIES   (1 << 20)
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    __u32 x = *(const __u32 *)a, y = *(const __u32 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* pid of the measurement thread, found by its name */
+static int engine_pid(const char *name)
+{
+    DIR *proc = opendir("/proc");
+    struct dirent *d;
+    char path[300], comm[32], want[32];
+    int pid = -1;
+
+    snprintf(want, sizeof(want), "%.15s\n", name);
+
+    while (proc && (d = readdir(proc))) {
+        FILE *f;
+
+        if (d->d_name[0] < '1' || d->d_name[0] > '9')
+            continue;
+        snprintf(path, sizeof(path), "/proc/%s/comm", d->d_name);
+        f = fopen(path, "r");
+        if (!f)
+            continue;
+        if (fgets(comm, sizeof(comm), f) && !strcmp(comm, want))
+            pid = atoi(d->d_name);
+        fclose(f);
+        if (pid > 0)
+            break;
+    }
+    if (proc)
+        closedir(proc);
+    return pid;
+}
+
+/* utime + stime of a thread in clock ticks */
+static unsigned long long cpu_ticks(int pid)
+{
+    unsigned long long utime = 0, stime = 0;
+    char path[64], buf[512], *p;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+    if (fgets(buf, sizeof(buf), f) && (p = strrchr(buf, ')')))
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime);
+    fclose(f);
+    return utime + stime;
+}
+
+/* Context switches of a thread, i.e. how often it slept and was woken up */
+static unsigned long long ctxt_switches(int pid)
+{
+    unsigned long long total = 0, n;
+    char path[64], line[128];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "voluntary_ctxt_switches: %llu", &n) == 1 ||
+            sscanf(line, "nonvoluntary_ctxt_switches: %llu", &n) == 1)
+            total += n;
+    }
+    fclose(f);
+    return total;
+}
+
+static unsigned int read_max_rate(void)
+{
+    unsigned int rate = 0;
+    FILE *f = fopen(MAX_RATE_PATH, "r");
+
+    if (f) {
+        if (fscanf(f, "%u", &rate) != 1)
+            rate = 0;
+        fclose(f);
+    }
+    return rate;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-r rate,...|max] [-s seconds] [-e distance_mm,...] [-i file|-] "
+            "[-n thread] [device]\n"
+            "  -r  rates to run, default 10,50,max\n"
+            "  -s  seconds per rate, default 5\n"
+            "  -e  simulated distance of each echo, for the distance error\n"
+            "  -i  read records from a file or pipe instead of the device, one run\n"
+            "  -n  name of the measurement thread, default " ENGINE_COMM "\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = DEVICE_PATH, *input = NULL, *comm = ENGINE_COMM;
+    char rates[128] = "10,50,max", *tok, *save;
+    double expected[DUAL_HCSR04_MAX_CHANNELS] = { 0 };
+    struct dual_hcsr04_record recs[64];
+    struct dual_hcsr04_config cfg, saved;
+    unsigned int seconds = 5;
+    __u32 *latencies;
+    long ticks_per_sec = sysconf(_SC_CLK_TCK);
+    int fd, pid, opt, i;
+
+    while ((opt = getopt(argc, argv, "r:s:e:i:n:")) != -1) {
+        switch (opt) {
+        case 'r':
+            snprintf(rates, sizeof(rates), "%s", optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'e':
+            for (i = 0, tok = strtok_r(optarg, ",", &save); tok && i < DUAL_HCSR04_MAX_CHANNELS;
+                 tok = strtok_r(NULL, ",", &save))
+                expected[i++] = atof(tok);
+            break;
+        case 'i':
+            input = optarg;
+            snprintf(rates, sizeof(rates), "0");
+            break;
+        case 'n':
+            comm = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        path = argv[optind];
+
+    memset(&saved, 0, sizeof(saved));
+    if (input) {
+        fd = strcmp(input, "-") ? open(input, O_RDONLY | O_NONBLOCK) : STDIN_FILENO;
+        if (fd < 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+            perror(input);
+            return 1;
+        }
+    } else {
+        fd = open(path, O_RDONLY | O_NONBLOCK);
+    }
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    if (!input && ioctl(fd, DUAL_HCSR04_IOC_GET_CONFIG, &saved)) {
+        perror("DUAL_HCSR04_IOC_GET_CONFIG");
+        return 1;
+    }
+    latencies = malloc(MAX_LATENCIES * sizeof(*latencies));
+    if (!latencies)
+        return 1;
+    pid = engine_pid(comm);
+
+    printf("%8s %10s %10s %10s %10s %8s %8s %10s %10s %10s %8s\n", "rate", "samples/s", "lat p50us",
+           "lat p99us", "lat maxus", "jit us", "cpu %", "wakeups/s", "err mm", "stddev mm", "timeouts");
+
+    for (tok = strtok_r(rates, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        unsigned long long start, end, ticks, switches, last = 0;
+        unsigned long samples = 0, timeouts = 0, errors = 0, n = 0, periods = 0;
+        double err_sum = 0, err_sq = 0, mean, period_sum = 0, period_sq = 0, period_mean, elapsed;
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        size_t have = 0;
+
+        cfg = saved;
+        cfg.rate = strcmp(tok, "max") ? (unsigned int)atoi(tok) : read_max_rate();
+        if (!input && ioctl(fd, DUAL_HCSR04_IOC_SET_CONFIG, &cfg)) {
+            fprintf(stderr, "rate %s: %s\n", tok, strerror(errno));
+            continue;
+        }
+        /* Drop what was measured before */
+        while (!input && read(fd, recs, sizeof(recs)) > 0)
+            ;
+
+        ticks = pid > 0 ? cpu_ticks(pid) : 0;
+        switches = pid > 0 ? ctxt_switches(pid) : 0;
+        start = now_ns();
+        end = start + seconds * 1000000000ull;
+        while (now_ns() < end) {
+            ssize_t len;
+
+            if (poll(&pfd, 1, 100) <= 0)
+                continue;
+            /* A pipe may split records */
+            len = read(fd, (char *)recs + have, sizeof(recs) - have);
+            if (len == 0 && input)
+                break;
+            if (len <= 0)
+                continue;
+            have += len;
+            for (i = 0; i < have / sizeof(recs[0]); i++) {
+                struct dual_hcsr04_record *r = &recs[i];
+                unsigned long long latency = now_ns() - r->timestamp_ns;
+
+                if (r->channel == 1) {
+                    if (last) {
+                        double p = (double)(r->timestamp_ns - last) / 1000;
+
+                        period_sum += p;
+                        period_sq += p * p;
+                        periods++;
+                    }
+                    last = r->timestamp_ns;
+                }
+
+                samples++;
+                if (n < MAX_LATENCIES)
+                    latencies[n++] = latency > 0xffffffffull ? 0xffffffff : latency;
+                if (r->flags & (DUAL_HCSR04_FLAG_TIMEOUT | DUAL_HCSR04_FLAG_GLITCH)) {
+                    timeouts++;
+                    continue;
+                }
+                if (r->channel >= 1 && r->channel <= DUAL_HCSR04_MAX_CHANNELS &&
+                    expected[r->channel - 1]) {
+                    double e = (double)r->distance / (1 << DUAL_HCSR04_DISTANCE_SHIFT) -
+                               expected[r->channel - 1];
+
+                    err_sum += e;
+                    err_sq += e * e;
+                    errors++;
+                }
+            }
+            have -= i * sizeof(recs[0]);
+            memmove(recs, &recs[i], have);
+        }
+        ticks = pid > 0 ? cpu_ticks(pid) - ticks : 0;
+        switches = pid > 0 ? ctxt_switches(pid) - switches : 0;
+        /* An input file may end before the time is up */
+        elapsed = (now_ns() - start) / 1e9;
+
+        qsort(latencies, n, sizeof(*latencies), cmp_u32);
+        mean = errors ? err_sum / errors : 0;
+        period_mean = periods ? period_sum / periods : 0;
+        printf("%8u %10.1f %10.1f %10.1f %10.1f %8.1f %8.2f %10.1f %10.2f %10.2f %8lu\n", cfg.rate,
+               samples / elapsed,
+               n ? latencies[n / 2] / 1000.0 : 0,
+               n ? latencies[n * 99 / 100] / 1000.0 : 0,
+               n ? latencies[n - 1] / 1000.0 : 0,
+               periods ? sqrt(period_sq / periods - period_mean * period_mean) : 0,
+               pid > 0 ? 100.0 * ticks / ticks_per_sec / elapsed : -1,
+               pid > 0 ? switches / elapsed : -1,
+               mean, errors ? sqrt(err_sq / errors - mean * mean) : 0, timeouts);
+        fflush(stdout);
+    }
+
+    if (!input)
+        ioctl(fd, DUAL_HCSR04_IOC_SET_CONFIG, &saved);
+    free(latencies);
+    close(fd);
+
+    return 0;
+}
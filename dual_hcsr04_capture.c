@@ -0,0 +1,179 @@
+/*
+ * Raw edge capture of the dual HC-SR04 driver.
+ *
+ * Turns on DUAL_HCSR04_CONFIG_CAPTURE, reads the trigger, echo edge and
+ * timeout events in DUAL_HCSR04_MODE_EDGES and writes them to a capture log
+ * (struct dual_hcsr04_capture_header followed by struct dual_hcsr04_edge).
+ * Optionally the records the driver published meanwhile are saved too, so
+ * dual_hcsr04_replay can check its output against them. The previous
+ * configuration is restored at the end.
+ *
+ * Author:
+ *  Linh Nguyen (nvl1109@gmail.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "dual_hcsr04.h"
+
+#define DEVICE_PATH     "/dev/dual_hcsr04"
+#define ECHO_GROUPS_PATH "/sys/module/gpiomod_dual_hcsr04/parameters/echo_groups"
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void read_echo_groups(__u8 *groups)
+{
+    FILE *f = fopen(ECHO_GROUPS_PATH, "r");
+    int i, g;
+
+    for (i = 0; i < DUAL_HCSR04_MAX_CHANNELS; i++) {
+        if (!f || fscanf(f, "%d,", &g) != 1)
+            g = 0;
+        groups[i] = g;
+    }
+    if (f)
+        fclose(f);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s seconds] [-r records.bin] <capture.bin> [device]\n"
+            "  -s  capture for this long, default until interrupted\n"
+            "  -r  also save the records published by the driver\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = DEVICE_PATH, *records_path = NULL;
+    struct dual_hcsr04_capture_header hdr;
+    struct dual_hcsr04_latest latest;
+    struct dual_hcsr04_config cfg;
+    struct dual_hcsr04_edge edges[256];
+    struct dual_hcsr04_record recs[64];
+    struct pollfd pfd[2];
+    unsigned long long end = 0, count = 0, lost = 0;
+    unsigned int seconds = 0, mode = DUAL_HCSR04_MODE_EDGES;
+    FILE *out, *records = NULL;
+    int fd, rfd = -1, opt, i;
+    ssize_t len;
+
+    while ((opt = getopt(argc, argv, "s:r:")) != -1) {
+        switch (opt) {
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'r':
+            records_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (optind + 1 < argc)
+        path = argv[optind + 1];
+
+    fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    if (ioctl(fd, DUAL_HCSR04_IOC_GET_CONFIG, &cfg) || ioctl(fd, DUAL_HCSR04_IOC_GET_LATEST, &latest) ||
+        ioctl(fd, DUAL_HCSR04_IOC_SET_MODE, &mode)) {
+        perror(path);
+        return 1;
+    }
+    out = fopen(argv[optind], "wb");
+    if (!out) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (records_path) {
+        rfd = open(path, O_RDONLY | O_NONBLOCK);
+        records = fopen(records_path, "wb");
+        if (rfd < 0 || !records) {
+            perror(records_path);
+            return 1;
+        }
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = DUAL_HCSR04_CAPTURE_MAGIC;
+    hdr.version = DUAL_HCSR04_CAPTURE_VERSION;
+    hdr.channels = latest.channels;
+    read_echo_groups(hdr.echo_groups);
+    hdr.config = cfg;
+    hdr.config.flags &= ~DUAL_HCSR04_CONFIG_CAPTURE;
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    /* Drop what was captured or measured before */
+    while (read(fd, edges, sizeof(edges)) > 0)
+        ;
+    while (rfd >= 0 && read(rfd, recs, sizeof(recs)) > 0)
+        ;
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    cfg.flags |= DUAL_HCSR04_CONFIG_CAPTURE;
+    if (ioctl(fd, DUAL_HCSR04_IOC_SET_CONFIG, &cfg)) {
+        perror("DUAL_HCSR04_IOC_SET_CONFIG");
+        return 1;
+    }
+
+    if (seconds)
+        end = now_ns() + seconds * 1000000000ull;
+    pfd[0].fd = fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = rfd;
+    pfd[1].events = POLLIN;
+    while (!stop && (!end || now_ns() < end)) {
+        if (poll(pfd, rfd >= 0 ? 2 : 1, 100) <= 0)
+            continue;
+        while ((len = read(fd, edges, sizeof(edges))) > 0) {
+            for (i = 0; i < len / sizeof(edges[0]); i++) {
+                if (edges[i].flags & DUAL_HCSR04_EDGE_FLAG_OVERFLOW)
+                    lost++;
+            }
+            fwrite(edges, 1, len, out);
+            count += len / sizeof(edges[0]);
+        }
+        while (rfd >= 0 && (len = read(rfd, recs, sizeof(recs))) > 0)
+            fwrite(recs, 1, len, records);
+    }
+
+    cfg.flags &= ~DUAL_HCSR04_CONFIG_CAPTURE;
+    ioctl(fd, DUAL_HCSR04_IOC_SET_CONFIG, &cfg);
+    fclose(out);
+    if (records)
+        fclose(records);
+    fprintf(stderr, "%llu edges captured, %llu gaps\n", count, lost);
+    close(fd);
+
+    return 0;
+}
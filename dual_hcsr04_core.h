@@ -0,0 +1,466 @@
+/*
+ * Dual Untrasonic HC-SR04 controller driver - measurement core.
+ *
+ * Conversion, filter and burst arithmetic of the driver, its trigger group
+ * scheduling and its per echo sample ring. Nothing here touches driver state, locks or GPIOs, so the core
+ * can be built and tested on its own by the KUnit suite in
+ * dual_hcsr04_core_test.c. Outside the kernel it builds against the userspace
+ * types, for dual_hcsr04_replay, dual_hcsr04_gpiod and dual_hcsr04_corebench.
+ *
+ * Author:
+ *  Linh Nguyen (nvl1109@gmail.com)
+ *
+ */
+
+#ifndef _DUAL_HCSR04_CORE_H
+#define _DUAL_HCSR04_CORE_H
+
+#include "dual_hcsr04.h"
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#include <linux/circ_buf.h>
+#include <asm/barrier.h>
+#else
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+typedef __u16 u16;
+typedef __u32 u32;
+typedef __s32 s32;
+typedef __u64 u64;
+typedef __s64 s64;
+
+#define NSEC_PER_SEC    1000000000ull
+#define U32_MAX         UINT32_MAX
+#define S32_MAX         INT32_MAX
+#define min_t(type, x, y) ((type)(x) < (type)(y) ? (type)(x) : (type)(y))
+#define max_t(type, x, y) ((type)(x) > (type)(y) ? (type)(x) : (type)(y))
+
+static inline u64 div_u64(u64 dividend, u32 divisor) { return dividend / divisor; }
+static inline s64 div_s64(s64 dividend, s32 divisor) { return dividend / divisor; }
+
+#define CIRC_CNT(head, tail, size)      (((head) - (tail)) & ((size) - 1))
+#define CIRC_SPACE(head, tail, size)    CIRC_CNT((tail), ((head) + 1), (size))
+#define READ_ONCE(x)                    __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define smp_load_acquire(p)             __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)         __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+#define HCSR04_SOUND_SPEED  (343000)    /* mm/s in air at 20 degC */
+#define HCSR04_MULT_SHIFT   (28)        /* fractional bits of a distance multiplier */
+
+/*
+ * Fastest speed of sound in mm/s hcsr04_distance_mult() can take: above
+ * 2^32 * NSEC_PER_SEC >> 43 its u32 result overflows (and from 2^21 mm/s on,
+ * speed << 43 overflows u64). Compensated air tops out at about 380.6 m/s, at
+ * DUAL_HCSR04_TEMPERATURE_MAX and DUAL_HCSR04_HUMIDITY_MAX.
+ */
+#define HCSR04_SOUND_SPEED_MAX  (488281)
+
+/*
+ * Reciprocal multiplier of hcsr04_distance() for a speed of sound in mm/s:
+ * (speed / 2) / NSEC_PER_SEC in fixed point, rounded. The speed must not be
+ * above HCSR04_SOUND_SPEED_MAX.
+ */
+static inline u32 hcsr04_distance_mult(unsigned int speed)
+{
+    const unsigned int shift = DUAL_HCSR04_DISTANCE_SHIFT + HCSR04_MULT_SHIFT - 1;
+
+    return div_u64(((u64)speed << shift) + NSEC_PER_SEC / 2, NSEC_PER_SEC);
+}
+
+/*
+ * Distance of an echo pulse width, in mm with DUAL_HCSR04_DISTANCE_SHIFT
+ * fractional bits. Sound travels there and back, so the distance is half of
+ * width * speed. Both factors fit 32 bits, so the product fits 64 bits.
+ */
+static inline s32 hcsr04_distance(u32 width_ns, u32 mult)
+{
+    u64 distance = ((u64)width_ns * mult) >> HCSR04_MULT_SHIFT;
+
+    return min_t(u64, distance, S32_MAX);
+}
+
+/*
+ * Echo pulse width from the edge times, clamped to 32 bits. Returns -EINVAL
+ * if the rising edge was missed or is not before the falling edge.
+ */
+static inline int hcsr04_echo_width(u64 start_ns, u64 end_ns, u32 *width_ns)
+{
+    if (!start_ns || start_ns >= end_ns)
+        return -EINVAL;
+    *width_ns = min_t(u64, end_ns - start_ns, U32_MAX);
+    return 0;
+}
+
+/*
+ * Integer square root. Not in the sampling path.
+ */
+static inline u32 hcsr04_sqrt(u64 x)
+{
+    u64 bit = 1ull << 62;
+    u64 root = 0;
+
+    while (bit > x)
+        bit >>= 2;
+    while (bit) {
+        if (x >= root + bit) {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+/*
+ * Speed of sound in mm/s. Dry air follows the ideal gas model
+ * c = 331.3 * sqrt(T / 273.15 K) m/s, water vapour adds about 0.0124 m/s per
+ * % RH. The temperature must be within DUAL_HCSR04_TEMPERATURE_MIN/MAX.
+ */
+static inline unsigned int hcsr04_sound_speed(s32 temperature_mc, u32 humidity_pct)
+{
+    /* milli Kelvin << 13, for the precision of the roots */
+    u64 temperature = (u64)(273150 + temperature_mc) << 13;
+    u64 freezing = 273150ull << 13;
+
+    return div_u64(331300ull * hcsr04_sqrt(temperature), hcsr04_sqrt(freezing)) + humidity_pct * 124 / 10;
+}
+
+/* Sort a few values in place, windows and bursts are at most 16 entries */
+static inline void hcsr04_sort(s32 *v, unsigned int n)
+{
+    unsigned int i, j;
+
+    for (i = 1; i < n; i++) {
+        s32 x = v[i];
+
+        for (j = i; j > 0 && v[j - 1] > x; j--)
+            v[j] = v[j - 1];
+        v[j] = x;
+    }
+}
+
+/*
+ * Sliding median and exponential moving average, see
+ * DUAL_HCSR04_FILTER_WINDOW_MAX.
+ * @window: last distances, pos is the oldest
+ * @count: valid entries in window, non-zero once output is valid
+ * @pos: next entry of window to replace
+ * @output: last filter output
+ */
+struct hcsr04_filter {
+    s32         window[DUAL_HCSR04_FILTER_WINDOW_MAX];
+    unsigned int count;
+    unsigned int pos;
+    s32         output;
+};
+
+static inline void hcsr04_filter_reset(struct hcsr04_filter *f)
+{
+    f->count = 0;
+    f->pos = 0;
+}
+
+/*
+ * Last output, 0 before the first distance.
+ */
+static inline s32 hcsr04_filter_output(const struct hcsr04_filter *f)
+{
+    return f->count ? f->output : 0;
+}
+
+/*
+ * Filter a distance with a median over window (odd, 0 or 1 for none) and an
+ * average with weight alpha / 256 (0 for none), return the new output.
+ */
+static inline s32 hcsr04_filter_update(struct hcsr04_filter *f, unsigned int window,
+                                       unsigned int alpha, s32 distance)
+{
+    s32 sorted[DUAL_HCSR04_FILTER_WINDOW_MAX];
+    bool primed = f->count;
+    s32 median = distance;
+
+    if (window > 1) {
+        f->window[f->pos] = distance;
+        f->pos = (f->pos + 1) % window;
+        if (f->count < window)
+            f->count++;
+        memcpy(sorted, f->window, f->count * sizeof(sorted[0]));
+        hcsr04_sort(sorted, f->count);
+        median = sorted[f->count / 2];
+    } else {
+        f->count = 1;
+    }
+
+    /* Both are non-negative s32, the difference cannot overflow */
+    if (alpha && primed)
+        f->output += ((s64)(median - f->output) * alpha) >> 8;
+    else
+        f->output = median;
+    return f->output;
+}
+
+/*
+ * Run a sample through the filter and set rec->filtered. Only valid distances
+ * enter the filter; timeouts and glitches get the last output. Without a
+ * median or an average the distance is passed through.
+ */
+static inline void hcsr04_filter_apply(struct hcsr04_filter *f, unsigned int window,
+                                       unsigned int alpha, struct dual_hcsr04_record *rec)
+{
+    if (rec->flags & (DUAL_HCSR04_FLAG_TIMEOUT | DUAL_HCSR04_FLAG_GLITCH))
+        rec->filtered = hcsr04_filter_output(f);
+    else if (window <= 1 && !alpha)
+        rec->filtered = rec->distance;
+    else
+        rec->filtered = hcsr04_filter_update(f, window, alpha, rec->distance);
+}
+
+/*
+ * Sample record of a finished echo of channel (from 1), ending at end_ns.
+ * flags are DUAL_HCSR04_FLAG_TIMEOUT (and BUSY) for an echo that timed out;
+ * otherwise the record gets the width and distance of the echo, or
+ * DUAL_HCSR04_FLAG_GLITCH if its rising edge was missed.
+ */
+static inline void hcsr04_echo_record(struct dual_hcsr04_record *rec, unsigned int channel,
+                                      u64 start_ns, u64 end_ns, u16 flags, u32 mult)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->version = DUAL_HCSR04_RECORD_VERSION;
+    rec->channel = channel;
+    rec->timestamp_ns = end_ns;
+    rec->flags = flags;
+    if (flags & DUAL_HCSR04_FLAG_TIMEOUT)
+        return;
+    if (hcsr04_echo_width(start_ns, end_ns, &rec->width_ns)) {
+        rec->flags |= DUAL_HCSR04_FLAG_GLITCH;
+        return;
+    }
+    rec->distance = hcsr04_distance(rec->width_ns, mult);
+    rec->pings = 1;
+}
+
+/*
+ * Pings of a burst, see DUAL_HCSR04_BURST_MAX.
+ * @distances: distances of the valid pings
+ * @width_sum: sum of the echo widths of the valid pings
+ * @pings: valid entries in distances
+ * @flags: flags of the invalid pings
+ */
+struct hcsr04_burst {
+    s32         distances[DUAL_HCSR04_BURST_MAX];
+    u64         width_sum;
+    unsigned int pings;
+    u16         flags;
+};
+
+static inline void hcsr04_burst_reset(struct hcsr04_burst *b)
+{
+    b->width_sum = 0;
+    b->pings = 0;
+    b->flags = 0;
+}
+
+static inline void hcsr04_burst_add(struct hcsr04_burst *b, s32 distance, u32 width_ns)
+{
+    if (b->pings >= DUAL_HCSR04_BURST_MAX)
+        return;
+    b->distances[b->pings++] = distance;
+    b->width_sum += width_ns;
+}
+
+/*
+ * Fill the distance, width, spread and pings of a record from the burst: mean
+ * or median of the valid pings and their standard deviation. Without any
+ * valid ping only the flags of the failed pings are set.
+ */
+static inline void hcsr04_burst_result(struct hcsr04_burst *b, bool median,
+                                       struct dual_hcsr04_record *rec)
+{
+    unsigned int n = b->pings;
+    s32 *d = b->distances;
+    s64 sum = 0, mean;
+    u64 var = 0;
+    unsigned int i;
+
+    if (!n) {
+        rec->flags |= b->flags;
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+        sum += d[i];
+    mean = div_s64(sum, n);
+    for (i = 0; i < n; i++)
+        var += (u64)((d[i] - mean) * (d[i] - mean));
+    rec->spread = hcsr04_sqrt(div_u64(var, n));
+    rec->width_ns = div_u64(b->width_sum, n);
+    rec->pings = n;
+
+    if (median) {
+        hcsr04_sort(d, n);
+        rec->distance = (n & 1) ? d[n / 2] : ((s64)d[n / 2 - 1] + d[n / 2]) >> 1;
+    } else {
+        rec->distance = mean;
+    }
+}
+
+/*
+ * Add the record of a ping from hcsr04_echo_record() to a burst: a distance,
+ * or the flags of a failed ping.
+ */
+static inline void hcsr04_burst_ping(struct hcsr04_burst *b, const struct dual_hcsr04_record *rec)
+{
+    if (rec->pings)
+        hcsr04_burst_add(b, rec->distance, rec->width_ns);
+    else
+        b->flags |= rec->flags;
+}
+
+/*
+ * Sample record of a finished burst of channel (from 1), see
+ * hcsr04_burst_result().
+ */
+static inline void hcsr04_burst_record(struct hcsr04_burst *b, unsigned int channel, u64 end_ns,
+                                       bool median, struct dual_hcsr04_record *rec)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->version = DUAL_HCSR04_RECORD_VERSION;
+    rec->channel = channel;
+    rec->timestamp_ns = end_ns;
+    hcsr04_burst_result(b, median, rec);
+}
+
+/*
+ * Scheduling state of a trigger group. Groups that can hear each other never
+ * measure at the same time and keep a quiet gap between their cycles.
+ * @crosstalk_mask: groups that can hear this group, including itself
+ * @due: the group has to measure
+ * @active: triggered, echoes are pending
+ * @start_ns: monotonic time of the last trigger
+ * @quiet_until_ns: groups in crosstalk_mask must not trigger before this
+ * @recover_until_ns: the group must not trigger before this
+ */
+struct hcsr04_group_sched {
+    unsigned long crosstalk_mask;
+    bool        due;
+    bool        active;
+    u64         start_ns;
+    u64         quiet_until_ns;
+    u64         recover_until_ns;
+};
+
+/*
+ * Pick the next of n groups to trigger at now: a due group that no active or
+ * still quiet group can hear. Of the groups that can, the one triggered
+ * longest ago goes first, so groups that hear each other and get ready
+ * together take turns. Returns -1 if no group can trigger yet, with *wake_ns
+ * the earliest time a due group only waits for, 0 if none.
+ */
+static inline int hcsr04_group_pick(const struct hcsr04_group_sched *groups, unsigned int n,
+                                    u64 now, u64 *wake_ns)
+{
+    unsigned int g, o;
+    int pick = -1;
+
+    *wake_ns = 0;
+    for (g = 0; g < n; g++) {
+        const struct hcsr04_group_sched *grp = &groups[g];
+        u64 ready_ns = max_t(u64, now, grp->recover_until_ns);
+
+        if (!grp->due || grp->active)
+            continue;
+        for (o = 0; o < n; o++) {
+            if (!(grp->crosstalk_mask & (1ul << o)))
+                continue;
+            if (groups[o].active)
+                break;
+            ready_ns = max_t(u64, ready_ns, groups[o].quiet_until_ns);
+        }
+        if (o < n)
+            continue;
+        if (ready_ns > now) {
+            if (!*wake_ns || ready_ns < *wake_ns)
+                *wake_ns = ready_ns;
+        } else if (pick < 0 || grp->start_ns < groups[pick].start_ns) {
+            pick = g;
+        }
+    }
+    return pick;
+}
+
+/*
+ * Sample ring of an echo: single producer (engine), single consumer (reader).
+ * @slots: samples, HCSR04_RING_SIZE of them
+ * @head: next slot written by the producer
+ * @tail: next slot read by the consumer
+ * @dropped: a sample was dropped, flag the next one pushed
+ */
+#define HCSR04_RING_SIZE    (256)   /* must be a power of 2 */
+
+struct hcsr04_ring {
+    struct dual_hcsr04_record slots[HCSR04_RING_SIZE];
+    unsigned int head;
+    unsigned int tail;
+    bool        dropped;
+};
+
+/*
+ * Push a sample, producer side. A full ring drops it and returns false; the
+ * next sample pushed then carries DUAL_HCSR04_FLAG_OVERFLOW.
+ */
+static inline bool hcsr04_ring_push(struct hcsr04_ring *r, const struct dual_hcsr04_record *rec)
+{
+    unsigned int head = r->head;
+    unsigned int tail = READ_ONCE(r->tail);
+
+    if (CIRC_SPACE(head, tail, HCSR04_RING_SIZE) == 0) {
+        r->dropped = true;
+        return false;
+    }
+    r->slots[head] = *rec;
+    if (r->dropped) {
+        r->slots[head].flags |= DUAL_HCSR04_FLAG_OVERFLOW;
+        r->dropped = false;
+    }
+    smp_store_release(&r->head, (head + 1) & (HCSR04_RING_SIZE - 1));
+    return true;
+}
+
+static inline bool hcsr04_ring_empty(struct hcsr04_ring *r)
+{
+    return CIRC_CNT(smp_load_acquire(&r->head), READ_ONCE(r->tail), HCSR04_RING_SIZE) == 0;
+}
+
+/*
+ * Copy the oldest unread sample without removing it, consumer side.
+ */
+static inline bool hcsr04_ring_peek(struct hcsr04_ring *r, struct dual_hcsr04_record *rec)
+{
+    unsigned int head = smp_load_acquire(&r->head);
+    unsigned int tail = r->tail;
+
+    if (CIRC_CNT(head, tail, HCSR04_RING_SIZE) == 0)
+        return false;
+    *rec = r->slots[tail];
+    return true;
+}
+
+/*
+ * Release the sample returned by hcsr04_ring_peek(), consumer side.
+ */
+static inline void hcsr04_ring_consume(struct hcsr04_ring *r)
+{
+    smp_store_release(&r->tail, (r->tail + 1) & (HCSR04_RING_SIZE - 1));
+}
+
+#endif /* _DUAL_HCSR04_CORE_H */
@@ -0,0 +1,369 @@
+/*
+ * Dual Untrasonic HC-SR04 controller driver - KUnit tests of the measurement
+ * core (dual_hcsr04_core.h).
+ *
+ * Covers the conversion at the edges of its range (no echo, the longest echo
+ * before a timeout, the fastest sound the compensation can give), its
+ * accuracy up to HCSR04_SOUND_SPEED_MAX, the speed of sound against the ideal
+ * gas model, the square root, the median and average filter, the burst
+ * statistics, the trigger group scheduling and the sample ring. Build with
+ * "make test" and load dual_hcsr04_core_test.ko on a kernel with
+ * CONFIG_KUNIT, the results are in the kernel log.
+ *
+ * Author:
+ *  Linh Nguyen (nvl1109@gmail.com)
+ *
+ */
+
+#include <kunit/test.h>
+
+#include "dual_hcsr04_core.h"
+
+#define MM(x)           ((s32)(x) << DUAL_HCSR04_DISTANCE_SHIFT)
+#define TOF_1000_MM     (5830904)   /* ns, echo width of 1000 mm at 343 m/s */
+#define TOF_4000_MM     (23323615)  /* ns, the longest echo in the specified range */
+
+static void hcsr04_test_distance_mult(struct kunit *test)
+{
+    /* round(speed << 43 / 1e9), from the reference in double precision */
+    KUNIT_EXPECT_EQ(test, hcsr04_distance_mult(HCSR04_SOUND_SPEED), 3017059907u);
+    KUNIT_EXPECT_EQ(test, hcsr04_distance_mult(0), 0u);
+}
+
+static void hcsr04_test_distance(struct kunit *test)
+{
+    u32 mult = hcsr04_distance_mult(HCSR04_SOUND_SPEED);
+
+    KUNIT_EXPECT_EQ(test, hcsr04_distance(0, mult), 0);
+    /* Within 1/16 mm of the exact distance */
+    KUNIT_EXPECT_LE(test, abs(hcsr04_distance(TOF_1000_MM, mult) - MM(1000)), MM(1) / 16);
+    KUNIT_EXPECT_LE(test, abs(hcsr04_distance(TOF_4000_MM, mult) - MM(4000)), MM(1) / 16);
+    /* A width clamped by hcsr04_echo_width() saturates, it does not wrap */
+    KUNIT_EXPECT_EQ(test, hcsr04_distance(U32_MAX, mult), S32_MAX);
+}
+
+static void hcsr04_test_distance_max_speed(struct kunit *test)
+{
+    unsigned int speed = hcsr04_sound_speed(DUAL_HCSR04_TEMPERATURE_MAX, DUAL_HCSR04_HUMIDITY_MAX);
+    u32 mult = hcsr04_distance_mult(speed);
+    u32 width = div_u64(4000ull * 2 * NSEC_PER_SEC, speed);
+
+    KUNIT_EXPECT_GT(test, mult, hcsr04_distance_mult(HCSR04_SOUND_SPEED));
+    KUNIT_EXPECT_LE(test, abs(hcsr04_distance(width, mult) - MM(4000)), MM(1) / 16);
+    KUNIT_EXPECT_EQ(test, hcsr04_distance(U32_MAX, mult), S32_MAX);
+}
+
+static void hcsr04_test_distance_mult_max(struct kunit *test)
+{
+    /* The last speed whose multiplier fits 32 bits, and the first that does not */
+    KUNIT_EXPECT_EQ(test, hcsr04_distance_mult(HCSR04_SOUND_SPEED_MAX), 4294965097u);
+    KUNIT_EXPECT_LT(test, hcsr04_distance_mult(HCSR04_SOUND_SPEED_MAX + 1),
+                    hcsr04_distance_mult(HCSR04_SOUND_SPEED_MAX));
+    KUNIT_EXPECT_LE(test, hcsr04_sound_speed(DUAL_HCSR04_TEMPERATURE_MAX, DUAL_HCSR04_HUMIDITY_MAX),
+                    (unsigned int)HCSR04_SOUND_SPEED_MAX);
+}
+
+/* Distances from 2 cm to 4 m within 1/16 mm, at any speed the driver takes */
+static void hcsr04_test_distance_accuracy(struct kunit *test)
+{
+    static const unsigned int speeds[] = { 306086, HCSR04_SOUND_SPEED, 380606, HCSR04_SOUND_SPEED_MAX };
+    static const unsigned int distances[] = { 20, 1000, 2500, 4000 };
+    int s, d;
+
+    for (s = 0; s < ARRAY_SIZE(speeds); s++) {
+        u32 mult = hcsr04_distance_mult(speeds[s]);
+
+        for (d = 0; d < ARRAY_SIZE(distances); d++) {
+            u32 width = div_u64((u64)distances[d] * 2 * NSEC_PER_SEC + speeds[s] / 2, speeds[s]);
+
+            KUNIT_EXPECT_LE_MSG(test, abs(hcsr04_distance(width, mult) - MM(distances[d])),
+                                MM(1) / 16, "%u mm at %u mm/s", distances[d], speeds[s]);
+        }
+    }
+}
+
+/* Ideal gas model and humidity term in double precision, within 10 mm/s */
+static void hcsr04_test_sound_speed(struct kunit *test)
+{
+    static const struct {
+        s32 temperature_mc;
+        u32 humidity_pct;
+        unsigned int speed;
+    } ref[] = {
+        { DUAL_HCSR04_TEMPERATURE_MIN, 0, 306083 },
+        { 0, 0, 331300 },
+        { 20000, 0, 343215 },
+        { 20000, 50, 343835 },
+        { DUAL_HCSR04_TEMPERATURE_MAX, DUAL_HCSR04_HUMIDITY_MAX, 380602 },
+    };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(ref); i++) {
+        unsigned int speed = hcsr04_sound_speed(ref[i].temperature_mc, ref[i].humidity_pct);
+
+        KUNIT_EXPECT_LE_MSG(test, abs((int)speed - (int)ref[i].speed), 10,
+                            "%d mC %u %%RH", ref[i].temperature_mc, ref[i].humidity_pct);
+    }
+}
+
+static void hcsr04_test_echo_width(struct kunit *test)
+{
+    u32 width = 1;
+
+    /* Missed rising edge, or edges out of order */
+    KUNIT_EXPECT_EQ(test, hcsr04_echo_width(0, 1000, &width), -EINVAL);
+    KUNIT_EXPECT_EQ(test, hcsr04_echo_width(1000, 1000, &width), -EINVAL);
+    KUNIT_EXPECT_EQ(test, hcsr04_echo_width(2000, 1000, &width), -EINVAL);
+    KUNIT_EXPECT_EQ(test, width, 1u);
+
+    KUNIT_EXPECT_EQ(test, hcsr04_echo_width(1000, 1000 + TOF_4000_MM, &width), 0);
+    KUNIT_EXPECT_EQ(test, width, (u32)TOF_4000_MM);
+    KUNIT_EXPECT_EQ(test, hcsr04_echo_width(1, 1 + (1ull << 33), &width), 0);
+    KUNIT_EXPECT_EQ(test, width, U32_MAX);
+}
+
+static void hcsr04_test_sqrt(struct kunit *test)
+{
+    KUNIT_EXPECT_EQ(test, hcsr04_sqrt(0), 0u);
+    KUNIT_EXPECT_EQ(test, hcsr04_sqrt(1), 1u);
+    KUNIT_EXPECT_EQ(test, hcsr04_sqrt(3), 1u);
+    KUNIT_EXPECT_EQ(test, hcsr04_sqrt(4), 2u);
+    KUNIT_EXPECT_EQ(test, hcsr04_sqrt(15), 3u);
+    KUNIT_EXPECT_EQ(test, hcsr04_sqrt(16), 4u);
+    KUNIT_EXPECT_EQ(test, hcsr04_sqrt(1000000), 1000u);
+    KUNIT_EXPECT_EQ(test, hcsr04_sqrt((u64)U32_MAX * U32_MAX), U32_MAX);
+    KUNIT_EXPECT_EQ(test, hcsr04_sqrt(~0ull), U32_MAX);
+}
+
+static void hcsr04_test_filter_median(struct kunit *test)
+{
+    struct hcsr04_filter f;
+
+    hcsr04_filter_reset(&f);
+    KUNIT_EXPECT_EQ(test, hcsr04_filter_output(&f), 0);
+
+    /* A single spike never reaches the output of a window of 3 */
+    KUNIT_EXPECT_EQ(test, hcsr04_filter_update(&f, 3, 0, MM(100)), MM(100));
+    KUNIT_EXPECT_EQ(test, hcsr04_filter_update(&f, 3, 0, MM(100)), MM(100));
+    KUNIT_EXPECT_EQ(test, hcsr04_filter_update(&f, 3, 0, MM(5000)), MM(100));
+    KUNIT_EXPECT_EQ(test, hcsr04_filter_update(&f, 3, 0, MM(120)), MM(120));
+    /* A step gets through once it fills half the window */
+    KUNIT_EXPECT_EQ(test, hcsr04_filter_update(&f, 3, 0, MM(5000)), MM(5000));
+    KUNIT_EXPECT_EQ(test, hcsr04_filter_output(&f), MM(5000));
+}
+
+static void hcsr04_test_filter_average(struct kunit *test)
+{
+    struct hcsr04_filter f;
+
+    hcsr04_filter_reset(&f);
+    /* The first distance primes the average */
+    KUNIT_EXPECT_EQ(test, hcsr04_filter_update(&f, 1, 128, MM(1000)), MM(1000));
+    KUNIT_EXPECT_EQ(test, hcsr04_filter_update(&f, 1, 128, MM(2000)), MM(1500));
+    /* A weight of one follows the input */
+    KUNIT_EXPECT_EQ(test, hcsr04_filter_update(&f, 1, DUAL_HCSR04_FILTER_ALPHA_ONE, MM(10)), MM(10));
+
+    /* Full range steps do not overflow */
+    hcsr04_filter_reset(&f);
+    hcsr04_filter_update(&f, 0, 255, 0);
+    KUNIT_EXPECT_EQ(test, hcsr04_filter_update(&f, 0, 255, S32_MAX), 2139095039);
+    KUNIT_EXPECT_GE(test, hcsr04_filter_update(&f, 0, 255, 0), 0);
+}
+
+static void hcsr04_test_burst(struct kunit *test)
+{
+    struct dual_hcsr04_record rec;
+    struct hcsr04_burst b;
+
+    hcsr04_burst_reset(&b);
+    hcsr04_burst_add(&b, MM(100), 1000);
+    hcsr04_burst_add(&b, MM(600), 2000);
+    hcsr04_burst_add(&b, MM(200), 3000);
+    memset(&rec, 0, sizeof(rec));
+    hcsr04_burst_result(&b, false, &rec);
+    KUNIT_EXPECT_EQ(test, rec.distance, MM(300));
+    KUNIT_EXPECT_EQ(test, rec.width_ns, 2000u);
+    KUNIT_EXPECT_EQ(test, rec.pings, 3);
+    /* sqrt(140000 / 3) mm, in the same fixed point as the distances */
+    KUNIT_EXPECT_EQ(test, rec.spread, hcsr04_sqrt(div_u64(140000ull << 32, 3)));
+
+    memset(&rec, 0, sizeof(rec));
+    hcsr04_burst_result(&b, true, &rec);
+    KUNIT_EXPECT_EQ(test, rec.distance, MM(200));
+
+    /* Even count, the median is the mean of the middle pair */
+    hcsr04_burst_add(&b, MM(1000), 4000);
+    memset(&rec, 0, sizeof(rec));
+    hcsr04_burst_result(&b, true, &rec);
+    KUNIT_EXPECT_EQ(test, rec.distance, MM(400));
+}
+
+static void hcsr04_test_burst_edges(struct kunit *test)
+{
+    struct dual_hcsr04_record rec;
+    struct hcsr04_burst b;
+    int i;
+
+    /* Only timeouts: no distance, the flags of the failed pings */
+    hcsr04_burst_reset(&b);
+    b.flags |= DUAL_HCSR04_FLAG_TIMEOUT;
+    memset(&rec, 0, sizeof(rec));
+    hcsr04_burst_result(&b, true, &rec);
+    KUNIT_EXPECT_EQ(test, rec.pings, 0);
+    KUNIT_EXPECT_EQ(test, rec.distance, 0);
+    KUNIT_EXPECT_EQ(test, rec.flags, DUAL_HCSR04_FLAG_TIMEOUT);
+
+    /* Pings beyond DUAL_HCSR04_BURST_MAX are ignored */
+    hcsr04_burst_reset(&b);
+    for (i = 0; i <= DUAL_HCSR04_BURST_MAX; i++)
+        hcsr04_burst_add(&b, S32_MAX, U32_MAX);
+    memset(&rec, 0, sizeof(rec));
+    hcsr04_burst_result(&b, false, &rec);
+    KUNIT_EXPECT_EQ(test, rec.pings, DUAL_HCSR04_BURST_MAX);
+    KUNIT_EXPECT_EQ(test, rec.distance, S32_MAX);
+    KUNIT_EXPECT_EQ(test, rec.width_ns, U32_MAX);
+    KUNIT_EXPECT_EQ(test, rec.spread, 0u);
+}
+
+static void hcsr04_test_group_pick(struct kunit *test)
+{
+    struct hcsr04_group_sched g[2] = {
+        { .crosstalk_mask = 0x3, .due = true },
+        { .crosstalk_mask = 0x3, .due = true },
+    };
+    u64 wake_ns;
+
+    /* Both are ready, the one triggered longest ago goes first */
+    g[0].start_ns = 200;
+    g[1].start_ns = 100;
+    KUNIT_EXPECT_EQ(test, hcsr04_group_pick(g, 2, 300, &wake_ns), 1);
+    g[1].start_ns = 300;
+    KUNIT_EXPECT_EQ(test, hcsr04_group_pick(g, 2, 300, &wake_ns), 0);
+
+    /* Nothing triggers while a group that hears it is active */
+    g[0].due = false;
+    g[0].active = true;
+    KUNIT_EXPECT_EQ(test, hcsr04_group_pick(g, 2, 300, &wake_ns), -1);
+    KUNIT_EXPECT_EQ(test, wake_ns, 0ull);
+
+    /* Then the quiet gap and the recovery hold it back */
+    g[0].active = false;
+    g[0].quiet_until_ns = 1000;
+    g[1].recover_until_ns = 2000;
+    KUNIT_EXPECT_EQ(test, hcsr04_group_pick(g, 2, 500, &wake_ns), -1);
+    KUNIT_EXPECT_EQ(test, wake_ns, 2000ull);
+    KUNIT_EXPECT_EQ(test, hcsr04_group_pick(g, 2, 2000, &wake_ns), 1);
+}
+
+/*
+ * Free run of two groups that hear each other and one that does not, the
+ * way the driver schedules them: all three must keep measuring.
+ */
+static void hcsr04_test_group_turns(struct kunit *test)
+{
+    struct hcsr04_group_sched g[3] = {
+        { .crosstalk_mask = 0x3, .due = true },
+        { .crosstalk_mask = 0x3, .due = true },
+        { .crosstalk_mask = 0x4, .due = true },
+    };
+    unsigned int cycles[3] = { 0 };
+    unsigned int n, i;
+    u64 done_ns[3], now = 1000000, wake_ns;
+    int p;
+
+    for (n = 0; n < 300; n++) {
+        while ((p = hcsr04_group_pick(g, 3, now, &wake_ns)) >= 0) {
+            g[p].due = false;
+            g[p].active = true;
+            g[p].start_ns = now;
+            done_ns[p] = now + 25000000;    /* echo timeout */
+        }
+        /* On to the next cycle end or gap timer */
+        for (i = 0; i < 3; i++) {
+            if (g[i].active && (!wake_ns || done_ns[i] < wake_ns))
+                wake_ns = done_ns[i];
+        }
+        KUNIT_ASSERT_TRUE(test, wake_ns > now);
+        now = wake_ns;
+        for (i = 0; i < 3; i++) {
+            if (!g[i].active || done_ns[i] > now)
+                continue;
+            g[i].active = false;
+            g[i].due = true;
+            g[i].quiet_until_ns = now + 10000000;
+            g[i].recover_until_ns = now + 2000000;
+            cycles[i]++;
+        }
+    }
+    KUNIT_EXPECT_GT(test, cycles[0], 50u);
+    KUNIT_EXPECT_LE(test, cycles[0], cycles[1] + 1);
+    KUNIT_EXPECT_LE(test, cycles[1], cycles[0] + 1);
+    /* The third group does not wait for the other two */
+    KUNIT_EXPECT_GT(test, cycles[2], cycles[0]);
+}
+
+static void hcsr04_test_ring(struct kunit *test)
+{
+    struct hcsr04_ring *r = kunit_kzalloc(test, sizeof(*r), GFP_KERNEL);
+    struct dual_hcsr04_record rec;
+    unsigned int i;
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, r);
+    KUNIT_EXPECT_TRUE(test, hcsr04_ring_empty(r));
+    KUNIT_EXPECT_FALSE(test, hcsr04_ring_peek(r, &rec));
+
+    /* One slot stays free */
+    memset(&rec, 0, sizeof(rec));
+    for (i = 0; i < HCSR04_RING_SIZE - 1; i++) {
+        rec.timestamp_ns = i;
+        KUNIT_EXPECT_TRUE(test, hcsr04_ring_push(r, &rec));
+    }
+    KUNIT_EXPECT_FALSE(test, hcsr04_ring_push(r, &rec));
+
+    /* Samples come out in order, and the one after a drop is flagged */
+    KUNIT_ASSERT_TRUE(test, hcsr04_ring_peek(r, &rec));
+    KUNIT_EXPECT_EQ(test, rec.timestamp_ns, 0ull);
+    hcsr04_ring_consume(r);
+    rec.timestamp_ns = HCSR04_RING_SIZE;
+    rec.flags = 0;
+    KUNIT_EXPECT_TRUE(test, hcsr04_ring_push(r, &rec));
+    for (i = 1; i < HCSR04_RING_SIZE - 1; i++) {
+        KUNIT_ASSERT_TRUE(test, hcsr04_ring_peek(r, &rec));
+        hcsr04_ring_consume(r);
+        KUNIT_EXPECT_EQ(test, rec.timestamp_ns, (u64)i);
+        KUNIT_EXPECT_EQ(test, rec.flags, 0);
+    }
+    KUNIT_ASSERT_TRUE(test, hcsr04_ring_peek(r, &rec));
+    hcsr04_ring_consume(r);
+    KUNIT_EXPECT_EQ(test, rec.timestamp_ns, (u64)HCSR04_RING_SIZE);
+    KUNIT_EXPECT_EQ(test, rec.flags, DUAL_HCSR04_FLAG_OVERFLOW);
+    KUNIT_EXPECT_TRUE(test, hcsr04_ring_empty(r));
+}
+
+static struct kunit_case hcsr04_core_test_cases[] = {
+    KUNIT_CASE(hcsr04_test_distance_mult),
+    KUNIT_CASE(hcsr04_test_distance),
+    KUNIT_CASE(hcsr04_test_distance_max_speed),
+    KUNIT_CASE(hcsr04_test_distance_mult_max),
+    KUNIT_CASE(hcsr04_test_distance_accuracy),
+    KUNIT_CASE(hcsr04_test_sound_speed),
+    KUNIT_CASE(hcsr04_test_echo_width),
+    KUNIT_CASE(hcsr04_test_sqrt),
+    KUNIT_CASE(hcsr04_test_filter_median),
+    KUNIT_CASE(hcsr04_test_filter_average),
+    KUNIT_CASE(hcsr04_test_burst),
+    KUNIT_CASE(hcsr04_test_burst_edges),
+    KUNIT_CASE(hcsr04_test_group_pick),
+    KUNIT_CASE(hcsr04_test_group_turns),
+    KUNIT_CASE(hcsr04_test_ring),
+    {}
+};
+
+static struct kunit_suite hcsr04_core_test_suite = {
+    .name = "dual_hcsr04_core",
+    .test_cases = hcsr04_core_test_cases,
+};
+kunit_test_suite(hcsr04_core_test_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("KUnit tests of the dual HC-SR04 measurement core");
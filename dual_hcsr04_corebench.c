@@ -0,0 +1,174 @@
+/*
+ * Micro benchmark of the dual HC-SR04 measurement core.
+ *
+ * Times the per sample work of the driver (dual_hcsr04_core.h) in a loop and
+ * reports ns per operation: the echo width to distance conversion, the median
+ * and average filter, a burst of pings, and a push and pop of the per echo
+ * sample ring. The core is the code the driver runs, built for userspace, so
+ * changes can be compared on any Linux machine.
+ *
+ * Author:
+ *  Linh Nguyen (nvl1109@gmail.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dual_hcsr04_core.h"
+
+#define DEFAULT_LOOPS   (10000000)
+
+/* Results go here so the loops are not optimized away */
+static volatile s64 sink;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void report(const char *name, unsigned long long start, unsigned long loops)
+{
+    printf("%-24s %10.2f\n", name, (double)(now_ns() - start) / loops);
+}
+
+/* Widths of echoes between 20 mm and 4 m, cycled through */
+static u32 widths[256];
+
+static void bench_conversion(unsigned long loops)
+{
+    u32 mult = hcsr04_distance_mult(HCSR04_SOUND_SPEED);
+    unsigned long long start = now_ns();
+    unsigned long n;
+    s64 sum = 0;
+    u32 width;
+
+    for (n = 0; n < loops; n++) {
+        u64 end = 1000000 + widths[n & 255];
+
+        if (!hcsr04_echo_width(1000000, end, &width))
+            sum += hcsr04_distance(width, mult);
+    }
+    sink = sum;
+    report("conversion", start, loops);
+}
+
+static void bench_filter(const char *name, unsigned int window, unsigned int alpha,
+                         unsigned long loops)
+{
+    struct hcsr04_filter f;
+    unsigned long long start;
+    unsigned long n;
+    s64 sum = 0;
+
+    hcsr04_filter_reset(&f);
+    start = now_ns();
+    for (n = 0; n < loops; n++)
+        sum += hcsr04_filter_update(&f, window, alpha, widths[n & 255] * 11);
+    sink = sum;
+    report(name, start, loops);
+}
+
+/* One op is a whole burst: pings adds and the result */
+static void bench_burst(const char *name, unsigned int pings, bool median, unsigned long loops)
+{
+    struct dual_hcsr04_record rec;
+    struct hcsr04_burst b;
+    unsigned long long start;
+    unsigned long n;
+    unsigned int p;
+    s64 sum = 0;
+
+    loops /= pings;
+    start = now_ns();
+    for (n = 0; n < loops; n++) {
+        hcsr04_burst_reset(&b);
+        for (p = 0; p < pings; p++)
+            hcsr04_burst_add(&b, widths[(n + p) & 255] * 11, widths[(n + p) & 255]);
+        rec.distance = 0;
+        hcsr04_burst_result(&b, median, &rec);
+        sum += rec.distance;
+    }
+    sink = sum;
+    report(name, start, loops);
+}
+
+/* One op is a push and a pop, through the same calls as the driver */
+static void bench_ring(unsigned long loops)
+{
+    struct hcsr04_ring *r = calloc(1, sizeof(*r));
+    struct dual_hcsr04_record rec = { .version = DUAL_HCSR04_RECORD_VERSION };
+    unsigned long long start;
+    unsigned long n;
+    s64 sum = 0;
+
+    if (!r)
+        return;
+    start = now_ns();
+    for (n = 0; n < loops; n++) {
+        rec.timestamp_ns = n;
+        hcsr04_ring_push(r, &rec);
+        if (hcsr04_ring_peek(r, &rec)) {
+            hcsr04_ring_consume(r);
+            sum += rec.timestamp_ns;
+        }
+    }
+    sink = sum;
+    report("ring push+pop", start, loops);
+
+    /* Producer a ring ahead of the consumer, as when a reader wakes up late */
+    start = now_ns();
+    for (n = 0; n < loops; n += HCSR04_RING_SIZE - 1) {
+        unsigned int i;
+
+        for (i = 0; i < HCSR04_RING_SIZE - 1; i++)
+            hcsr04_ring_push(r, &rec);
+        while (hcsr04_ring_peek(r, &rec)) {
+            hcsr04_ring_consume(r);
+            sum += rec.flags;
+        }
+    }
+    sink = sum;
+    report("ring push+pop, batched", start, n);
+    free(r);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long loops = DEFAULT_LOOPS;
+    unsigned int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            loops = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n loops]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!loops)
+        loops = DEFAULT_LOOPS;
+
+    srand(1);
+    for (i = 0; i < 256; i++)
+        widths[i] = 116618 + rand() % (23323615 - 116618);
+
+    printf("%-24s %10s\n", "operation", "ns/op");
+    bench_conversion(loops);
+    bench_filter("filter off", 1, 0, loops);
+    bench_filter("filter median 5", 5, 0, loops);
+    bench_filter("filter median 15 + avg", DUAL_HCSR04_FILTER_WINDOW_MAX, 64, loops);
+    bench_burst("burst 4 mean", 4, false, loops);
+    bench_burst("burst 16 median", DUAL_HCSR04_BURST_MAX, true, loops);
+    bench_ring(loops);
+
+    return 0;
+}
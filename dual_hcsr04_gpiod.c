@@ -0,0 +1,438 @@
+/*
+ * Userspace measurement engine for dual HC-SR04 sensors, for systems that
+ * cannot load gpiomod_dual_hcsr04.
+ *
+ * Drives the trigger line and takes the echo edges through the GPIO
+ * character device (v2 uAPI, the interface libgpiod 2 is built on). Edges
+ * carry kernel CLOCK_MONOTONIC timestamps and are read in batches, so the
+ * echo widths do not depend on when this process gets scheduled. Conversion,
+ * filter and burst code is the driver's (dual_hcsr04_core.h), and samples are
+ * written as the driver's struct dual_hcsr04_record, or its text lines with
+ * -T, so consumers can read either.
+ *
+ * All echoes share one trigger line, like the default wiring of the module:
+ * trigger on GPIO16, echoes on GPIO20 and GPIO21 of gpiochip0.
+ *
+ * Author:
+ *  Linh Nguyen (nvl1109@gmail.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/gpio.h>
+
+#include "dual_hcsr04_core.h"
+
+#define CHIP_PATH       "/dev/gpiochip0"
+#define TRIGGER_LINE    (16)
+#define MAXIMUM_RANGE   (4000)      /* mm, HC-SR04 specified range */
+#define DEFAULT_RANGE   (3300)      /* mm */
+#define ECHO_START_DELAY (500)      /* us from trigger to echo start, burst included */
+#define TRIGGER_PULSE   (10000)     /* ns, HC-SR04 needs at least 10 us */
+#define EVENT_BATCH     (16)        /* edge events per read() */
+
+/*
+ * Per echo state, as in the driver.
+ * @offset: echo line offset on the chip
+ * @pending: triggered, waiting for the echo to end or time out
+ * @start_ns: monotonic time of the rising edge, 0 until seen in this cycle
+ * @end_ns: monotonic time of the falling edge or the timeout
+ * @flags: DUAL_HCSR04_FLAG_TIMEOUT if the echo timed out
+ * @filter: median and average of the valid distances
+ * @burst: valid pings of the current burst
+ */
+struct echo_channel {
+    unsigned int offset;
+    bool        pending;
+    u64         start_ns;
+    u64         end_ns;
+    u16         flags;
+    struct hcsr04_filter filter;
+    struct hcsr04_burst burst;
+};
+
+static struct echo_channel channels[DUAL_HCSR04_MAX_CHANNELS];
+static unsigned int num_channels;
+static int trigger_fd, echo_fd, out_fd = STDOUT_FILENO;
+static struct dual_hcsr04_config config = {
+    .rate = 10,
+    .max_range_mm = DEFAULT_RANGE,
+};
+static bool text_output;
+static u32 distance_mult;
+static u64 echo_timeout_ns;
+
+/* Samples of the current tick, written at once */
+static struct dual_hcsr04_record out[DUAL_HCSR04_MAX_CHANNELS];
+static unsigned int out_count;
+
+/* Counters, printed at exit */
+static unsigned long samples, timeouts, glitches, overruns;
+static u64 jitter_max_ns;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(u64 ns)
+{
+    struct timespec ts = { ns / 1000000000ull, ns % 1000000000ull };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !stop)
+        ;
+}
+
+static int request_lines(const char *chip, unsigned int trigger)
+{
+    struct gpio_v2_line_request req;
+    unsigned int i;
+    int fd;
+
+    fd = open(chip, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        perror(chip);
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.offsets[0] = trigger;
+    req.num_lines = 1;
+    req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    snprintf(req.consumer, sizeof(req.consumer), "dual_hcsr04 trigger");
+    if (ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req)) {
+        perror("trigger line");
+        return -1;
+    }
+    trigger_fd = req.fd;
+
+    /* Edges are timestamped by the kernel, on CLOCK_MONOTONIC by default */
+    memset(&req, 0, sizeof(req));
+    for (i = 0; i < num_channels; i++)
+        req.offsets[i] = channels[i].offset;
+    req.num_lines = num_channels;
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING |
+                       GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    req.event_buffer_size = EVENT_BATCH * num_channels;
+    snprintf(req.consumer, sizeof(req.consumer), "dual_hcsr04 echo");
+    if (ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req)) {
+        perror("echo lines");
+        return -1;
+    }
+    echo_fd = req.fd;
+    fcntl(echo_fd, F_SETFL, fcntl(echo_fd, F_GETFL) | O_NONBLOCK);
+    close(fd);
+
+    return 0;
+}
+
+static void set_trigger(int value)
+{
+    struct gpio_v2_line_values values = { .bits = value, .mask = 1 };
+
+    ioctl(trigger_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+}
+
+/* Filter a sample and queue it, as the driver's publish_record() */
+static void publish(struct dual_hcsr04_record *rec)
+{
+    hcsr04_filter_apply(&channels[rec->channel - 1].filter, config.filter_window,
+                        config.filter_alpha, rec);
+    out[out_count++] = *rec;
+    samples++;
+}
+
+/* Write the samples of the tick, in the driver's binary or text format */
+static void flush_samples(void)
+{
+    char text[DUAL_HCSR04_MAX_CHANNELS * 48];
+    bool micrometre = config.flags & DUAL_HCSR04_CONFIG_MICROMETRE;
+    int len = 0;
+    long long distance;
+    unsigned int i;
+
+    if (!out_count)
+        return;
+    if (!text_output) {
+        if (write(out_fd, out, out_count * sizeof(out[0])) < 0 && errno == EPIPE)
+            stop = 1;
+        out_count = 0;
+        return;
+    }
+    for (i = 0; i < out_count; i++) {
+        if (out[i].flags & DUAL_HCSR04_FLAG_TIMEOUT)
+            distance = -1;
+        else if (micrometre)
+            distance = ((s64)out[i].distance * 1000) >> DUAL_HCSR04_DISTANCE_SHIFT;
+        else
+            distance = out[i].distance >> DUAL_HCSR04_DISTANCE_SHIFT;
+        len += snprintf(text + len, sizeof(text) - len, "%d %llu %lld\n", out[i].channel,
+                        (unsigned long long)out[i].timestamp_ns, distance);
+    }
+    if (write(out_fd, text, len) < 0 && errno == EPIPE)
+        stop = 1;
+    out_count = 0;
+}
+
+/* The engine loop of the driver for one finished echo */
+static void finish_echo(unsigned int index, bool burst)
+{
+    struct echo_channel *ch = &channels[index];
+    struct dual_hcsr04_record rec;
+
+    hcsr04_echo_record(&rec, index + 1, ch->start_ns, ch->end_ns, ch->flags, distance_mult);
+    if (rec.flags & DUAL_HCSR04_FLAG_TIMEOUT)
+        timeouts++;
+    else if (rec.flags & DUAL_HCSR04_FLAG_GLITCH)
+        glitches++;
+
+    if (!burst)
+        publish(&rec);
+    else
+        hcsr04_burst_ping(&ch->burst, &rec);
+}
+
+/*
+ * One trigger cycle: fire the trigger, then take the echo edges in batches
+ * until every echo has ended or the echo timeout is over.
+ */
+static void measure_cycle(bool burst)
+{
+    struct gpio_v2_line_event events[EVENT_BATCH];
+    struct pollfd pfd = { .fd = echo_fd, .events = POLLIN };
+    struct gpio_v2_line_values levels = { .mask = (1ull << num_channels) - 1 };
+    unsigned int pending = num_channels, i;
+    u64 t0, deadline, now;
+    ssize_t len;
+    int n, e;
+
+    // Echo lines are low before the trigger, drop stale edges
+    while (read(echo_fd, events, sizeof(events)) > 0)
+        ;
+    // An echo still high is waiting out a missed echo and will not measure
+    if (ioctl(echo_fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &levels))
+        levels.bits = 0;
+    for (i = 0; i < num_channels; i++) {
+        channels[i].pending = !(levels.bits & (1ull << i));
+        channels[i].start_ns = 0;
+    }
+
+    t0 = now_ns();
+    set_trigger(1);
+    while (now_ns() < t0 + TRIGGER_PULSE)
+        ;
+    set_trigger(0);
+    deadline = t0 + echo_timeout_ns;
+    for (i = 0; i < num_channels; i++) {
+        if (channels[i].pending)
+            continue;
+        channels[i].end_ns = t0;
+        channels[i].flags = DUAL_HCSR04_FLAG_TIMEOUT | DUAL_HCSR04_FLAG_BUSY;
+        finish_echo(i, burst);
+        pending--;
+    }
+
+    while (pending && !stop) {
+        now = now_ns();
+        if (now >= deadline)
+            break;
+        if (poll(&pfd, 1, (deadline - now + 999999) / 1000000) <= 0)
+            continue;
+        len = read(echo_fd, events, sizeof(events));
+        for (n = 0; n < len / (ssize_t)sizeof(events[0]); n++) {
+            for (e = 0; e < num_channels && channels[e].offset != events[n].offset; e++)
+                ;
+            if (e == num_channels)
+                continue;
+            if (events[n].id == GPIO_V2_LINE_EVENT_RISING_EDGE) {
+                // Echo started
+                channels[e].start_ns = events[n].timestamp_ns;
+            } else if (channels[e].pending) {
+                // Echo ended
+                channels[e].pending = false;
+                channels[e].end_ns = events[n].timestamp_ns;
+                channels[e].flags = 0;
+                finish_echo(e, burst);
+                pending--;
+            }
+        }
+    }
+    for (i = 0; i < num_channels; i++) {
+        if (!channels[i].pending)
+            continue;
+        channels[i].pending = false;
+        channels[i].end_ns = deadline;
+        channels[i].flags = DUAL_HCSR04_FLAG_TIMEOUT;
+        finish_echo(i, burst);
+    }
+}
+
+/*
+ * One sampling tick: a single cycle, or burst_count cycles recovery_us apart
+ * and one record per echo from their pings.
+ */
+static void measure_tick(void)
+{
+    unsigned int pings = config.burst_count > 1 ? config.burst_count : 1;
+    struct dual_hcsr04_record rec;
+    unsigned int p, i;
+
+    for (i = 0; i < num_channels; i++)
+        hcsr04_burst_reset(&channels[i].burst);
+    for (p = 0; p < pings && !stop; p++) {
+        if (p)
+            sleep_until(now_ns() + (u64)config.recovery_us * 1000);
+        measure_cycle(pings > 1);
+    }
+    if (pings > 1) {
+        for (i = 0; i < num_channels; i++) {
+            hcsr04_burst_record(&channels[i].burst, i + 1, channels[i].end_ns,
+                                config.flags & DUAL_HCSR04_CONFIG_BURST_MEDIAN, &rec);
+            publish(&rec);
+        }
+    }
+    flush_samples();
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "  -c chip     GPIO chip, default " CHIP_PATH "\n"
+            "  -t line     trigger line offset, default 16\n"
+            "  -e lines    echo line offsets, default 20,21\n"
+            "  -r rate     samples per second, default 10\n"
+            "  -m mm       maximum range, default 3300\n"
+            "  -w window   median filter window, odd, default 0\n"
+            "  -a alpha    moving average weight in 1/256, default 0\n"
+            "  -b count    pings per sample (burst), -M for the median\n"
+            "  -g us       recovery between burst pings, default 2000\n"
+            "  -C mC,%%RH   compensate for air temperature and humidity\n"
+            "  -o file     write samples to file instead of stdout\n"
+            "  -T          text lines, in um with -u\n"
+            "  -p prio     run with SCHED_FIFO priority\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *chip = CHIP_PATH, *out_path = NULL;
+    unsigned int trigger = TRIGGER_LINE, speed = HCSR04_SOUND_SPEED;
+    char echos[64] = "20,21", *tok, *save;
+    struct sched_param sp = { 0 };
+    u64 period, next, now;
+    int opt;
+
+    config.recovery_us = 2000;
+    while ((opt = getopt(argc, argv, "c:t:e:r:m:w:a:b:Mg:C:o:Tup:")) != -1) {
+        switch (opt) {
+        case 'c': chip = optarg; break;
+        case 't': trigger = atoi(optarg); break;
+        case 'e': snprintf(echos, sizeof(echos), "%s", optarg); break;
+        case 'r': config.rate = atoi(optarg); break;
+        case 'm': config.max_range_mm = atoi(optarg); break;
+        case 'w': config.filter_window = atoi(optarg); break;
+        case 'a': config.filter_alpha = atoi(optarg); break;
+        case 'b': config.burst_count = atoi(optarg); break;
+        case 'M': config.flags |= DUAL_HCSR04_CONFIG_BURST_MEDIAN; break;
+        case 'g': config.recovery_us = atoi(optarg); break;
+        case 'C':
+            if (sscanf(optarg, "%d,%u", &config.temperature_mc, &config.humidity_pct) < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            config.flags |= DUAL_HCSR04_CONFIG_COMPENSATE;
+            break;
+        case 'o': out_path = optarg; break;
+        case 'T': text_output = true; break;
+        case 'u': config.flags |= DUAL_HCSR04_CONFIG_MICROMETRE; break;
+        case 'p': sp.sched_priority = atoi(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    for (tok = strtok_r(echos, ",", &save); tok && num_channels < DUAL_HCSR04_MAX_CHANNELS;
+         tok = strtok_r(NULL, ",", &save))
+        channels[num_channels++].offset = atoi(tok);
+
+    /* Same limits as the driver's apply_config() */
+    if (!config.rate || !num_channels || config.max_range_mm < 20 ||
+        config.max_range_mm > MAXIMUM_RANGE || config.burst_count > DUAL_HCSR04_BURST_MAX ||
+        config.filter_window > DUAL_HCSR04_FILTER_WINDOW_MAX ||
+        (config.filter_window > 1 && !(config.filter_window & 1)) ||
+        config.filter_alpha > DUAL_HCSR04_FILTER_ALPHA_ONE ||
+        config.temperature_mc < DUAL_HCSR04_TEMPERATURE_MIN ||
+        config.temperature_mc > DUAL_HCSR04_TEMPERATURE_MAX ||
+        config.humidity_pct > DUAL_HCSR04_HUMIDITY_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (config.flags & DUAL_HCSR04_CONFIG_COMPENSATE)
+        speed = hcsr04_sound_speed(config.temperature_mc, config.humidity_pct);
+    if (!speed || speed > HCSR04_SOUND_SPEED_MAX) {
+        fprintf(stderr, "speed of sound %u mm/s out of range\n", speed);
+        return 1;
+    }
+    distance_mult = hcsr04_distance_mult(speed);
+    echo_timeout_ns = (ECHO_START_DELAY + (u64)config.max_range_mm * 2 * 1000000 / speed) * 1000;
+
+    if (out_path) {
+        out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_fd < 0) {
+            perror(out_path);
+            return 1;
+        }
+    }
+    if (request_lines(chip, trigger))
+        return 1;
+    if (sp.sched_priority) {
+        if (sched_setscheduler(0, SCHED_FIFO, &sp))
+            perror("sched_setscheduler");
+        mlockall(MCL_CURRENT | MCL_FUTURE);
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Sampling ticks on absolute deadlines, so the period does not drift */
+    period = 1000000000ull / config.rate;
+    next = now_ns() + period;
+    while (!stop) {
+        sleep_until(next);
+        now = now_ns();
+        if (now - next > jitter_max_ns)
+            jitter_max_ns = now - next;
+        next += period;
+        while (next <= now) {
+            next += period;
+            overruns++;
+        }
+        measure_tick();
+    }
+
+    fprintf(stderr, "%lu samples, %lu timeouts, %lu glitches, %lu overruns, "
+            "jitter max %llu ns\n", samples, timeouts, glitches, overruns,
+            (unsigned long long)jitter_max_ns);
+    close(echo_fd);
+    close(trigger_fd);
+
+    return 0;
+}
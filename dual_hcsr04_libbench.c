@@ -0,0 +1,154 @@
+/*
+ * Throughput benchmark of the libdualhcsr04 access paths.
+ *
+ * Reads samples for a while through each path (mmap ring, read(), and the
+ * DUAL_HCSR04_IOC_READ ioctl) and batch size, waiting with
+ * dualhcsr04_wait() in between, and reports the samples per second and the
+ * CPU time this process spent per sample. Run it with the driver sampling as
+ * fast as it can, e.g. free running against dual_hcsr04_sim.
+ *
+ * Author:
+ *  Linh Nguyen (nvl1109@gmail.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "libdualhcsr04.h"
+
+#define MAX_BATCH       (256)
+
+static const struct {
+    const char *name;
+    unsigned int flags;
+} paths[] = {
+    { "mmap",  0 },
+    { "read",  DUALHCSR04_NO_MMAP },
+    { "ioctl", DUALHCSR04_NO_MMAP | DUALHCSR04_IOCTL_READ },
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* CPU time of this process in ns */
+static unsigned long long cpu_ns(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ull +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ull;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s seconds] [-b batch,...] [-r rate] [-f] [device]\n"
+            "  -s  seconds per path and batch, default 3\n"
+            "  -b  batch sizes, default 1,16,256\n"
+            "  -r  sampling rate during the run, default unchanged\n"
+            "  -f  free run during the run\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = NULL;
+    char batches[64] = "1,16,256", *tok, *save;
+    struct dual_hcsr04_record recs[MAX_BATCH];
+    struct dual_hcsr04_config cfg, saved;
+    struct dualhcsr04 *dev;
+    unsigned int seconds = 3, rate = 0, batch;
+    int free_run = 0, opt, p, n;
+
+    while ((opt = getopt(argc, argv, "s:b:r:f")) != -1) {
+        switch (opt) {
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'b':
+            snprintf(batches, sizeof(batches), "%s", optarg);
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 'f':
+            free_run = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        path = argv[optind];
+
+    /* This handle only sets the configuration */
+    dev = dualhcsr04_open(path, DUALHCSR04_NO_MMAP);
+    if (!dev) {
+        perror(path ? path : DUALHCSR04_DEVICE_PATH);
+        return 1;
+    }
+    if (dualhcsr04_get_config(dev, &saved))
+        return 1;
+    cfg = saved;
+    if (rate)
+        cfg.rate = rate;
+    if (free_run)
+        cfg.flags |= DUAL_HCSR04_CONFIG_FREE_RUN;
+    if ((rate || free_run) && (n = dualhcsr04_set_config(dev, &cfg))) {
+        fprintf(stderr, "set config: %s\n", strerror(-n));
+        return 1;
+    }
+
+    printf("%6s %6s %12s %10s %12s %10s\n", "path", "batch", "samples/s", "calls/s", "cpu ns/smp", "lost");
+    for (tok = strtok_r(batches, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        batch = atoi(tok);
+        if (batch < 1 || batch > MAX_BATCH)
+            continue;
+        for (p = 0; p < sizeof(paths) / sizeof(paths[0]); p++) {
+            struct dualhcsr04 *bench = dualhcsr04_open(path, paths[p].flags);
+            unsigned long long start, end, cpu, samples = 0, calls = 0;
+
+            if (!bench) {
+                perror(paths[p].name);
+                continue;
+            }
+            /* Drop what was measured before */
+            while (dualhcsr04_read(bench, recs, MAX_BATCH) > 0)
+                ;
+            cpu = cpu_ns();
+            start = now_ns();
+            end = start + seconds * 1000000000ull;
+            while (now_ns() < end) {
+                if (dualhcsr04_wait(bench, 100) <= 0)
+                    continue;
+                do {
+                    n = dualhcsr04_read(bench, recs, batch);
+                    calls++;
+                    if (n > 0)
+                        samples += n;
+                } while (n > 0);
+            }
+            cpu = cpu_ns() - cpu;
+            printf("%6s %6u %12.1f %10.1f %12.0f %10llu\n", paths[p].name, batch,
+                   samples * 1e9 / (now_ns() - start), calls * 1e9 / (now_ns() - start),
+                   samples ? (double)cpu / samples : 0, dualhcsr04_lost(bench));
+            fflush(stdout);
+            dualhcsr04_close(bench);
+        }
+    }
+
+    dualhcsr04_set_config(dev, &saved);
+    dualhcsr04_close(dev);
+
+    return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * Example consumer of the dual HC-SR04 shared sample ring.
+ *
+ * Maps /dev/dual_hcsr04 and follows the producer head without any syscall
+ * per sample. Once a second it prints the number of samples consumed, the
+ * samples lost because the consumer fell behind and the latest distances,
+ * taken from the per echo snapshots in the header.
+ *
+ * Author:
+ *  Linh Nguyen (nvl1109@gmail.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dual_hcsr04.h"
+
+#define DEVICE_PATH     "/dev/dual_hcsr04"
+
+static __u64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Copy the last sample of an echo, retrying while the driver updates it */
+static void read_latest(const volatile struct dual_hcsr04_latest_slot *slot,
+                        struct dual_hcsr04_record *rec)
+{
+    __u32 seq;
+
+    for (;;) {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        *rec = *(const struct dual_hcsr04_record *)&slot->record;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+            return;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : DEVICE_PATH;
+    const volatile struct dual_hcsr04_mmap_header *hdr;
+    const volatile struct dual_hcsr04_record *ring;
+    struct dual_hcsr04_record sample;
+    unsigned long consumed = 0, lost = 0;
+    __u64 next_report;
+    size_t size;
+    void *area;
+    __u32 cursor, head, mask;
+    int fd, i;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+
+    /* Map the header first to learn the ring geometry */
+    area = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+    if (area == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    hdr = area;
+    if (hdr->magic != DUAL_HCSR04_MMAP_MAGIC || hdr->version != DUAL_HCSR04_MMAP_VERSION) {
+        fprintf(stderr, "Unsupported ring format %08x v%u\n", hdr->magic, hdr->version);
+        return 1;
+    }
+    size = hdr->data_offset + hdr->ring_size * sizeof(sample);
+    munmap(area, sysconf(_SC_PAGESIZE));
+
+    area = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (area == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    close(fd);
+
+    hdr = area;
+    ring = (const void *)((const char *)area + hdr->data_offset);
+    mask = hdr->ring_size - 1;
+
+    /* Start with the samples published from now on */
+    cursor = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    next_report = now_ns() + 1000000000ull;
+
+    for (;;) {
+        head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+        if (head - cursor > mask + 1) {
+            /* Lapped by the producer, skip to the oldest valid slot */
+            lost += head - cursor - (mask + 1);
+            cursor = head - (mask + 1);
+        }
+        while (cursor != head) {
+            sample = *(const struct dual_hcsr04_record *)&ring[cursor & mask];
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+            if (head - cursor >= mask + 1) {
+                /* Slot may have been overwritten while copying it */
+                lost++;
+                cursor++;
+                continue;
+            }
+            consumed++;
+            cursor++;
+        }
+
+        if (now_ns() >= next_report) {
+            printf("%lu samples/s, %lu lost:", consumed, lost);
+            for (i = 0; i < hdr->channels; i++) {
+                read_latest(&hdr->latest[i], &sample);
+                if (!sample.version)
+                    continue;
+                if (sample.flags & DUAL_HCSR04_FLAG_TIMEOUT)
+                    printf(" echo%d=timeout", i + 1);
+                else
+                    printf(" echo%d=%.1fmm", i + 1,
+                           (double)sample.distance / (1 << DUAL_HCSR04_DISTANCE_SHIFT));
+            }
+            printf("\n");
+            fflush(stdout);
+            consumed = 0;
+            lost = 0;
+            next_report += 1000000000ull;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,347 @@
+/*
+ * Deterministic replay of a dual HC-SR04 capture log.
+ *
+ * Feeds the events of a dual_hcsr04_capture log through the conversion,
+ * filter and burst code of the driver (dual_hcsr04_core.h) as fast as
+ * possible, following the engine: a trigger starts a cycle of its group, an
+ * echo end or timeout finishes a pending echo, and a burst is published when
+ * its last cycle is complete. The same log always gives the same records, so
+ * changes of the core can be checked for speed and accuracy on any Linux
+ * machine, without the sensors or the driver.
+ *
+ * Records are written to -o in the binary read() format. With -c, they are
+ * compared with the records the driver published during the capture, echo by
+ * echo from the first record of the replay on.
+ *
+ * Author:
+ *  Linh Nguyen (nvl1109@gmail.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dual_hcsr04_core.h"
+
+#define MAX_GROUPS      (4)
+
+struct replay_channel {
+    int         group;
+    bool        pending;
+    u64         start_ns;
+    u64         end_ns;
+    u16         flags;
+    struct hcsr04_filter filter;
+    struct hcsr04_burst burst;
+};
+
+struct replay_group {
+    unsigned long channel_mask;
+    unsigned long done_mask;
+    unsigned int burst_total;
+    unsigned int burst_left;
+};
+
+static struct dual_hcsr04_capture_header hdr;
+static struct replay_channel channels[DUAL_HCSR04_MAX_CHANNELS];
+static struct replay_group groups[MAX_GROUPS];
+static u32 distance_mult;
+
+/* Output of a run, echo by echo */
+static struct dual_hcsr04_record *out;
+static size_t out_count, out_size;
+static unsigned long timeouts, glitches;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *load_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    void *buf = NULL;
+    long len;
+
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    if (!fseek(f, 0, SEEK_END) && (len = ftell(f)) > 0 && !fseek(f, 0, SEEK_SET)) {
+        buf = malloc(len);
+        if (buf && fread(buf, 1, len, f) != (size_t)len) {
+            free(buf);
+            buf = NULL;
+        }
+        *size = len;
+    }
+    fclose(f);
+    if (!buf)
+        fprintf(stderr, "%s: unable to read\n", path);
+    return buf;
+}
+
+static void replay_reset(void)
+{
+    unsigned int i;
+
+    memset(channels, 0, sizeof(channels));
+    memset(groups, 0, sizeof(groups));
+    for (i = 0; i < hdr.channels; i++) {
+        channels[i].group = hdr.echo_groups[i] % MAX_GROUPS;
+        groups[channels[i].group].channel_mask |= 1ul << i;
+    }
+    out_count = 0;
+    timeouts = 0;
+    glitches = 0;
+}
+
+/* Filter a sample and keep it, as the driver's publish_record() */
+static void publish(struct dual_hcsr04_record *rec)
+{
+    hcsr04_filter_apply(&channels[rec->channel - 1].filter, hdr.config.filter_window,
+                        hdr.config.filter_alpha, rec);
+
+    if (out_count == out_size) {
+        out_size = out_size ? out_size * 2 : 4096;
+        out = realloc(out, out_size * sizeof(*out));
+        if (!out) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    out[out_count++] = *rec;
+}
+
+/* The driver's trigger_group_start() */
+static void replay_trigger(int g)
+{
+    struct replay_group *grp = &groups[g];
+    unsigned int i;
+
+    for (i = 0; i < hdr.channels; i++) {
+        if (!(grp->channel_mask & (1ul << i)))
+            continue;
+        channels[i].start_ns = 0;
+        channels[i].pending = true;
+    }
+    if (!grp->burst_left) {
+        grp->burst_total = hdr.config.burst_count < 1 ? 1 :
+                           hdr.config.burst_count > DUAL_HCSR04_BURST_MAX ? DUAL_HCSR04_BURST_MAX :
+                           hdr.config.burst_count;
+        grp->burst_left = grp->burst_total;
+        for (i = 0; i < hdr.channels; i++) {
+            if (grp->channel_mask & (1ul << i))
+                hcsr04_burst_reset(&channels[i].burst);
+        }
+    }
+    grp->burst_left--;
+    grp->done_mask = 0;
+}
+
+/* The driver's engine loop and trigger_groups_complete() for one echo */
+static void replay_finish(int index)
+{
+    struct replay_channel *ch = &channels[index];
+    struct replay_group *grp = &groups[ch->group];
+    struct dual_hcsr04_record rec;
+    unsigned int i;
+
+    hcsr04_echo_record(&rec, index + 1, ch->start_ns, ch->end_ns, ch->flags, distance_mult);
+    if (rec.flags & DUAL_HCSR04_FLAG_TIMEOUT)
+        timeouts++;
+    else if (rec.flags & DUAL_HCSR04_FLAG_GLITCH)
+        glitches++;
+
+    grp->done_mask |= 1ul << index;
+    if (grp->burst_total <= 1) {
+        publish(&rec);
+        return;
+    }
+    hcsr04_burst_ping(&ch->burst, &rec);
+    if (grp->done_mask != grp->channel_mask || grp->burst_left)
+        return;
+    for (i = 0; i < hdr.channels; i++) {
+        if (!(grp->channel_mask & (1ul << i)))
+            continue;
+        hcsr04_burst_record(&channels[i].burst, i + 1, channels[i].end_ns,
+                            hdr.config.flags & DUAL_HCSR04_CONFIG_BURST_MEDIAN, &rec);
+        publish(&rec);
+    }
+}
+
+static void replay(const struct dual_hcsr04_edge *edges, size_t count)
+{
+    size_t n;
+
+    for (n = 0; n < count; n++) {
+        const struct dual_hcsr04_edge *e = &edges[n];
+        int i = e->index - 1;
+
+        if (e->type == DUAL_HCSR04_EDGE_TRIGGER) {
+            if (e->index < MAX_GROUPS)
+                replay_trigger(e->index);
+            continue;
+        }
+        if (i < 0 || i >= (int)hdr.channels)
+            continue;
+        if (e->type == DUAL_HCSR04_EDGE_RISING) {
+            channels[i].start_ns = e->timestamp_ns;
+        } else if (channels[i].pending) {
+            channels[i].pending = false;
+            channels[i].end_ns = e->timestamp_ns;
+            if (e->type == DUAL_HCSR04_EDGE_BUSY)
+                channels[i].flags = DUAL_HCSR04_FLAG_TIMEOUT | DUAL_HCSR04_FLAG_BUSY;
+            else if (e->type == DUAL_HCSR04_EDGE_TIMEOUT)
+                channels[i].flags = DUAL_HCSR04_FLAG_TIMEOUT;
+            else
+                channels[i].flags = 0;
+            replay_finish(i);
+        }
+    }
+}
+
+/*
+ * Compare the replay with the driver's records. Both are aligned per echo on
+ * the timestamp of the first replayed record, the driver may have published
+ * records of cycles that started before the capture.
+ */
+static void compare(const struct dual_hcsr04_record *ref, size_t ref_count)
+{
+    unsigned long compared = 0, mismatches = 0;
+    unsigned int c;
+    size_t r, o;
+
+    for (c = 1; c <= hdr.channels; c++) {
+        for (o = 0; o < out_count && out[o].channel != c; o++)
+            ;
+        for (r = 0; r < ref_count && o < out_count; r++) {
+            if (ref[r].channel != c || ref[r].timestamp_ns < out[o].timestamp_ns)
+                continue;
+            if (ref[r].distance != out[o].distance || ref[r].filtered != out[o].filtered ||
+                ref[r].width_ns != out[o].width_ns || ref[r].spread != out[o].spread ||
+                (ref[r].flags & ~DUAL_HCSR04_FLAG_OVERFLOW) != out[o].flags) {
+                if (mismatches < 10)
+                    printf("echo %u at %llu: driver %d/%d, replay %d/%d\n", c,
+                           (unsigned long long)out[o].timestamp_ns, ref[r].distance,
+                           ref[r].filtered, out[o].distance, out[o].filtered);
+                mismatches++;
+            }
+            compared++;
+            for (o++; o < out_count && out[o].channel != c; o++)
+                ;
+        }
+    }
+    printf("compared %lu records, %lu mismatches\n", compared, mismatches);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n runs] [-o records.bin] [-c records.bin] <capture.bin>\n"
+            "  -n  replay this many times for the timing, default 1\n"
+            "  -o  write the replayed records\n"
+            "  -c  compare with the records saved by dual_hcsr04_capture -r\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *out_path = NULL, *ref_path = NULL;
+    const struct dual_hcsr04_edge *edges;
+    unsigned long long start, elapsed, span = 0;
+    unsigned int runs = 1, run, speed;
+    size_t size, count;
+    char *log;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:o:c:")) != -1) {
+        switch (opt) {
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'c':
+            ref_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || !runs) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    log = load_file(argv[optind], &size);
+    if (!log)
+        return 1;
+    if (size < sizeof(hdr)) {
+        fprintf(stderr, "%s: too short\n", argv[optind]);
+        return 1;
+    }
+    memcpy(&hdr, log, sizeof(hdr));
+    if (hdr.magic != DUAL_HCSR04_CAPTURE_MAGIC || hdr.version != DUAL_HCSR04_CAPTURE_VERSION ||
+        hdr.channels > DUAL_HCSR04_MAX_CHANNELS) {
+        fprintf(stderr, "%s: not a capture log\n", argv[optind]);
+        return 1;
+    }
+    edges = (const struct dual_hcsr04_edge *)(log + sizeof(hdr));
+    count = (size - sizeof(hdr)) / sizeof(*edges);
+    if (count)
+        span = edges[count - 1].timestamp_ns - edges[0].timestamp_ns;
+
+    /* The driver's config_sound_speed() */
+    if (hdr.config.flags & DUAL_HCSR04_CONFIG_COMPENSATE)
+        speed = hcsr04_sound_speed(hdr.config.temperature_mc, hdr.config.humidity_pct);
+    else
+        speed = HCSR04_SOUND_SPEED;
+    if (!speed || speed > HCSR04_SOUND_SPEED_MAX) {
+        fprintf(stderr, "%s: speed of sound %u mm/s out of range\n", argv[optind], speed);
+        return 1;
+    }
+    distance_mult = hcsr04_distance_mult(speed);
+
+    start = now_ns();
+    for (run = 0; run < runs; run++) {
+        replay_reset();
+        replay(edges, count);
+    }
+    elapsed = now_ns() - start;
+
+    printf("%zu edges, %zu records, %lu timeouts, %lu glitches, %u mm/s\n",
+           count, out_count, timeouts, glitches, speed);
+    printf("%.1f ns/edge, %.0f edges/s, %.0fx real time\n",
+           count ? (double)elapsed / runs / count : 0,
+           elapsed ? (double)count * runs * 1e9 / elapsed : 0,
+           elapsed ? (double)span * runs / elapsed : 0);
+
+    if (out_path) {
+        FILE *f = fopen(out_path, "wb");
+
+        if (!f || fwrite(out, sizeof(*out), out_count, f) != out_count) {
+            perror(out_path);
+            return 1;
+        }
+        fclose(f);
+    }
+    if (ref_path) {
+        struct dual_hcsr04_record *ref = load_file(ref_path, &size);
+
+        if (!ref)
+            return 1;
+        compare(ref, size / sizeof(*ref));
+        free(ref);
+    }
+    free(out);
+    free(log);
+
+    return 0;
+}
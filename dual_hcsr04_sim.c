@@ -0,0 +1,215 @@
+/*
+ * HC-SR04 echo simulator on top of the kernel gpio-sim driver.
+ *
+ * Watches the trigger line of a gpio-sim chip and answers every trigger
+ * pulse like HC-SR04 sensors would: each echo line goes high after the
+ * burst delay and stays high for the time of flight of its programmed
+ * distance. gpio_sim_setup.sh creates the chip and loads the driver on it.
+ *
+ * The trigger line belongs to the driver, so it cannot be requested for edge
+ * events; its sysfs value is read in a busy loop instead, a read takes a
+ * couple of us against the 10 us trigger pulse. Run it with -r on a spare
+ * CPU so it is not preempted in the middle of a pulse.
+ *
+ * The distance profile is a text file with one "<ms> <echo> <distance_mm>"
+ * line per change: from <ms> after the start on, echo <echo> (starting at 1)
+ * reports <distance_mm>, 0 for no echo. Without a profile every echo reports
+ * 1000 mm. Lines must be in time order.
+ *
+ * Author:
+ *  Linh Nguyen (nvl1109@gmail.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define MAX_ECHOS       (8)
+#define MAX_STEPS       (1024)
+#define SOUND_SPEED     (343000)    /* mm/s in air at 20 degC */
+#define BURST_DELAY     (250000)    /* ns from trigger to echo start */
+#define SPIN_MARGIN     (100000)    /* ns spun before an echo ends */
+
+struct step {
+    unsigned long ms;
+    int         echo;
+    unsigned int distance_mm;
+};
+
+static struct step steps[MAX_STEPS];
+static int num_steps;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(unsigned long long ns)
+{
+    struct timespec ts;
+
+    /* Sleep most of the way, then spin for a precise echo width */
+    if (ns > now_ns() + SPIN_MARGIN) {
+        ns -= SPIN_MARGIN;
+        ts.tv_sec = ns / 1000000000ull;
+        ts.tv_nsec = ns % 1000000000ull;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        ns += SPIN_MARGIN;
+    }
+    while (now_ns() < ns)
+        ;
+}
+
+static int open_line(const char *chip, int line, const char *attr, int flags)
+{
+    char path[256];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/sim_gpio%d/%s", chip, line, attr);
+    fd = open(path, flags);
+    if (fd < 0)
+        perror(path);
+    return fd;
+}
+
+static int load_profile(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[128];
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) && num_steps < MAX_STEPS) {
+        struct step *s = &steps[num_steps];
+
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%lu %d %u", &s->ms, &s->echo, &s->distance_mm) != 3)
+            continue;
+        if (s->echo < 1 || s->echo > MAX_ECHOS) {
+            fprintf(stderr, "%s: bad echo %d\n", path, s->echo);
+            fclose(f);
+            return -1;
+        }
+        num_steps++;
+    }
+    fclose(f);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s -c <gpio-sim chip sysfs dir> [-t trigger line] "
+            "[-n echos] [-p profile] [-r priority]\n"
+            "  echo N is on line trigger + N, e.g. /sys/devices/platform/gpio-sim.0/gpiochip2\n"
+            "  -r  run with SCHED_FIFO at this priority\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *chip = NULL, *profile = NULL;
+    unsigned int distance[MAX_ECHOS];
+    int pull[MAX_ECHOS];
+    int trigger = 0, num_echos = 2;
+    unsigned long long start, t0, end[MAX_ECHOS];
+    unsigned long triggers = 0;
+    struct sched_param sp = { 0 };
+    int value_fd, next_step = 0;
+    char prev = '0', cur;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "c:t:n:p:r:")) != -1) {
+        switch (opt) {
+        case 'c': chip = optarg; break;
+        case 't': trigger = atoi(optarg); break;
+        case 'n': num_echos = atoi(optarg); break;
+        case 'p': profile = optarg; break;
+        case 'r': sp.sched_priority = atoi(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (!chip || num_echos < 1 || num_echos > MAX_ECHOS) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (profile && load_profile(profile))
+        return 1;
+    if (sp.sched_priority && sched_setscheduler(0, SCHED_FIFO, &sp)) {
+        perror("sched_setscheduler");
+        return 1;
+    }
+
+    value_fd = open_line(chip, trigger, "value", O_RDONLY);
+    if (value_fd < 0)
+        return 1;
+    for (i = 0; i < num_echos; i++) {
+        pull[i] = open_line(chip, trigger + 1 + i, "pull", O_WRONLY);
+        if (pull[i] < 0)
+            return 1;
+        pwrite(pull[i], "pull-down", 9, 0);
+        distance[i] = 1000;
+    }
+
+    memset(end, 0, sizeof(end));
+    start = now_ns();
+    for (;;) {
+        /* Spin, a sleep would outlast the trigger pulse */
+        if (pread(value_fd, &cur, 1, 0) != 1) {
+            perror("trigger");
+            return 1;
+        }
+        if (!(prev == '0' && cur == '1')) {
+            prev = cur;
+            continue;
+        }
+        prev = cur;
+        t0 = now_ns();
+        triggers++;
+
+        /* Apply the profile steps that are due */
+        while (next_step < num_steps && steps[next_step].ms * 1000000ull <= t0 - start) {
+            if (steps[next_step].echo <= num_echos)
+                distance[steps[next_step].echo - 1] = steps[next_step].distance_mm;
+            next_step++;
+        }
+
+        /* All echoes start after the burst, each ends after its time of flight */
+        sleep_until(t0 + BURST_DELAY);
+        t0 = now_ns();
+        for (i = 0; i < num_echos; i++) {
+            if (!distance[i])
+                continue;
+            end[i] = t0 + (unsigned long long)distance[i] * 2 * 1000000000ull / SOUND_SPEED;
+            pwrite(pull[i], "pull-up", 7, 0);
+        }
+        for (;;) {
+            int first = -1;
+
+            for (i = 0; i < num_echos; i++) {
+                if (distance[i] && end[i] && (first < 0 || end[i] < end[first]))
+                    first = i;
+            }
+            if (first < 0)
+                break;
+            sleep_until(end[first]);
+            pwrite(pull[first], "pull-down", 9, 0);
+            end[first] = 0;
+        }
+        if (!(triggers % 1000))
+            fprintf(stderr, "%lu triggers\n", triggers);
+    }
+
+    return 0;
+}
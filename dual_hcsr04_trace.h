@@ -0,0 +1,95 @@
+/*
+ * Dual Untrasonic HC-SR04 controller driver - tracepoints.
+ *
+ * Author:
+ *  Linh Nguyen (nvl1109@gmail.com)
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dual_hcsr04
+
+#if !defined(_DUAL_HCSR04_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DUAL_HCSR04_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Trigger pulse of a trigger group, group numbers start at 0 */
+TRACE_EVENT(dual_hcsr04_trigger,
+    TP_PROTO(int group, u64 timestamp_ns),
+    TP_ARGS(group, timestamp_ns),
+    TP_STRUCT__entry(
+        __field(int, group)
+        __field(u64, timestamp_ns)
+    ),
+    TP_fast_assign(
+        __entry->group = group;
+        __entry->timestamp_ns = timestamp_ns;
+    ),
+    TP_printk("group=%d timestamp_ns=%llu", __entry->group, __entry->timestamp_ns)
+);
+
+/* Echo edge seen by the IRQ handler, echo numbers start at 1 */
+TRACE_EVENT(dual_hcsr04_edge,
+    TP_PROTO(int channel, bool rising, u64 timestamp_ns),
+    TP_ARGS(channel, rising, timestamp_ns),
+    TP_STRUCT__entry(
+        __field(int, channel)
+        __field(bool, rising)
+        __field(u64, timestamp_ns)
+    ),
+    TP_fast_assign(
+        __entry->channel = channel;
+        __entry->rising = rising;
+        __entry->timestamp_ns = timestamp_ns;
+    ),
+    TP_printk("echo=%d edge=%s timestamp_ns=%llu", __entry->channel,
+              __entry->rising ? "rising" : "falling", __entry->timestamp_ns)
+);
+
+/* Echo that did not end before the echo timeout */
+TRACE_EVENT(dual_hcsr04_timeout,
+    TP_PROTO(int channel, u64 timestamp_ns),
+    TP_ARGS(channel, timestamp_ns),
+    TP_STRUCT__entry(
+        __field(int, channel)
+        __field(u64, timestamp_ns)
+    ),
+    TP_fast_assign(
+        __entry->channel = channel;
+        __entry->timestamp_ns = timestamp_ns;
+    ),
+    TP_printk("echo=%d timestamp_ns=%llu", __entry->channel, __entry->timestamp_ns)
+);
+
+/* Sample published to the rings, distance in mm with 16 fractional bits */
+TRACE_EVENT(dual_hcsr04_publish,
+    TP_PROTO(const struct dual_hcsr04_record *rec),
+    TP_ARGS(rec),
+    TP_STRUCT__entry(
+        __field(int, channel)
+        __field(u16, flags)
+        __field(u32, width_ns)
+        __field(u64, timestamp_ns)
+        __field(s32, distance)
+    ),
+    TP_fast_assign(
+        __entry->channel = rec->channel;
+        __entry->flags = rec->flags;
+        __entry->width_ns = rec->width_ns;
+        __entry->timestamp_ns = rec->timestamp_ns;
+        __entry->distance = rec->distance;
+    ),
+    TP_printk("echo=%d timestamp_ns=%llu width_ns=%u distance_mm=%d flags=0x%x",
+              __entry->channel, __entry->timestamp_ns, __entry->width_ns,
+              __entry->distance >> DUAL_HCSR04_DISTANCE_SHIFT, __entry->flags)
+);
+
+#endif /* _DUAL_HCSR04_TRACE_H */
+
+/* The module is built out of tree, look for this header next to it */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dual_hcsr04_trace
+#include <trace/define_trace.h>
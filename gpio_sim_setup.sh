@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# Create a gpio-sim chip for the dual HC-SR04 driver and load the driver on it.
+# Line 0 is the trigger, lines 1..N the echoes. Needs CONFIG_GPIO_SIM,
+# configfs and the GPIO sysfs class (CONFIG_GPIO_SYSFS), and root.
+#
+#   ./gpio_sim_setup.sh [echos]      set up and load
+#   ./gpio_sim_setup.sh chip [echos] set up only, for dual_hcsr04_gpiod
+#   ./gpio_sim_setup.sh remove       unload and remove the chip
+#
+# Author:
+#  Linh Nguyen (nvl1109@gmail.com)
+#
+
+set -e
+
+sim=/sys/kernel/config/gpio-sim/dual_hcsr04
+label=dual_hcsr04-sim
+
+if [ "$1" = "remove" ]; then
+    rmmod gpiomod_dual_hcsr04 2>/dev/null || true
+    if [ -d $sim ]; then
+        echo 0 > $sim/live
+        rmdir $sim/bank0 $sim
+    fi
+    exit 0
+fi
+
+load=yes
+if [ "$1" = "chip" ]; then
+    load=no
+    shift
+fi
+echos=${1:-2}
+
+modprobe gpio-sim
+mkdir -p $sim/bank0
+echo $((echos + 1)) > $sim/bank0/num_lines
+echo $label > $sim/bank0/label
+echo 1 > $sim/live
+
+chip=/sys/devices/platform/$(cat $sim/dev_name)/$(cat $sim/bank0/chip_name)
+
+if [ $load = no ]; then
+    lines=1
+    i=2
+    while [ $i -le $echos ]; do
+        lines=$lines,$i
+        i=$((i + 1))
+    done
+    echo "Simulate with: ./dual_hcsr04_sim -c $chip -n $echos"
+    echo "Measure with:  ./dual_hcsr04_gpiod -c /dev/$(cat $sim/bank0/chip_name) -t 0 -e $lines"
+    exit 0
+fi
+
+# The driver takes legacy GPIO numbers, find the base of the new chip
+base=
+for dir in /sys/class/gpio/gpiochip*; do
+    if [ "$(cat $dir/label 2>/dev/null)" = "$label" ]; then
+        base=$(cat $dir/base)
+        break
+    fi
+done
+if [ -z "$base" ]; then
+    echo "Unable to find the GPIO base of $label" >&2
+    exit 1
+fi
+
+gpios=$((base + 1))
+i=2
+while [ $i -le $echos ]; do
+    gpios=$gpios,$((base + i))
+    i=$((i + 1))
+done
+
+insmod ./gpiomod_dual_hcsr04.ko trigger_gpios=$base echo_gpios=$gpios
+[ -e /dev/dual_hcsr04 ] || mknod /dev/dual_hcsr04 c 119 0
+
+echo "Simulate with: ./dual_hcsr04_sim -c $chip -n $echos"
@@ -13,48 +13,342 @@
 #include <linux/gpio.h>
 #include <linux/interrupt.h>
 #include <linux/sched.h>
-#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/delay.h>
 #include <linux/init.h>
 #include <linux/string.h>
 #include <linux/fs.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/circ_buf.h>
+#include <linux/bitops.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+#include <linux/compat.h>
+#if IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+#endif
 #include <asm/uaccess.h>
 
+#include "dual_hcsr04.h"
+#include "dual_hcsr04_core.h"
+
+#define CREATE_TRACE_POINTS
+#include "dual_hcsr04_trace.h"
+
 #define DEVICE_MAJOR    (119)
 #define DEVICE_NAME     "dual_hcsr04"
-#define MAXIMUM_RATE    (50)
+#define MAXIMUM_RATE    (50)        /* samples/s, unless in short range mode */
+#define MAX_CHANNELS    (DUAL_HCSR04_MAX_CHANNELS) /* echo channels, at most BITS_PER_LONG */
+#define MAX_GROUPS      (4)         /* trigger groups, one trigger GPIO each */
+#define MINIMUM_RANGE   (20)        /* mm, HC-SR04 blind zone */
+#define MAXIMUM_RANGE   (4000)      /* mm, HC-SR04 specified range */
+#define DEFAULT_RANGE   (3300)      /* mm, echo timeout fits a MAXIMUM_RATE period */
+#define ECHO_START_DELAY (500)      /* us from trigger to echo start, burst included */
+#define TRIGGER_PULSE   (10)        /* us, HC-SR04 minimum trigger pulse */
+#define MAXIMUM_QUIET_GAP (100000)  /* us between groups that hear each other */
+#define DEFAULT_RECOVERY (2000)     /* us before a free running group re-triggers */
+#define READ_BATCH      (16)        /* records copied to user per copy_to_user() */
+#define MMAP_RING_SIZE  (1024)  /* shared samples, must be a power of 2 */
+#define EDGE_RING_SIZE  (1024)  /* captured raw edges, must be a power of 2 */
+#define HIST_BUCKETS    (32)    /* log2 buckets of the debugfs histograms */
+#define MMAP_AREA_SIZE  (PAGE_SIZE + PAGE_ALIGN(MMAP_RING_SIZE * sizeof(struct dual_hcsr04_record)))
+
+/* High resolution timer, used to create an periodic sampling tick */
+static struct hrtimer schedule_timer;
+static ktime_t schedule_period;
+
+/* Wakes the engine when a quiet gap between trigger groups is over */
+static struct hrtimer gap_timer;
+
+/* Define GPIOs for trigger pins, one trigger group each */
+static int trigger_gpios[MAX_GROUPS] = { 16 };
+static int num_groups = 1;
+module_param_array(trigger_gpios, int, &num_groups, 0444);
+MODULE_PARM_DESC(trigger_gpios, "GPIOs of the trigger pins, one trigger group each (default 16)");
+
+static struct gpio triggers[MAX_GROUPS];
+
+/* Define GPIOs for echo pins, one channel per echo */
+static int echo_gpios[MAX_CHANNELS] = { 20, 21 };
+static int num_channels = 2;
+module_param_array(echo_gpios, int, &num_channels, 0444);
+MODULE_PARM_DESC(echo_gpios, "GPIOs of the sensor echo pins, one channel each (default 20,21)");
+
+static struct gpio echos[MAX_CHANNELS];
+
+/* Trigger group of each echo channel */
+static int echo_groups[MAX_CHANNELS];
+module_param_array(echo_groups, int, NULL, 0444);
+MODULE_PARM_DESC(echo_groups, "Trigger group of each echo (default all 0)");
+
+/* Groups whose sensors can hear each group, bit N is group N */
+static int group_crosstalk[MAX_GROUPS] = { [0 ... MAX_GROUPS - 1] = 0xff };
+module_param_array(group_crosstalk, int, NULL, 0444);
+MODULE_PARM_DESC(group_crosstalk, "Bitmask of groups that can hear each group (default all)");
+
+/*
+ * Per trigger group state. Groups that can hear each other never measure at
+ * the same time and keep config.quiet_gap_us between their cycles; other
+ * groups measure in parallel.
+ * @trigger: trigger GPIO
+ * @label: trigger GPIO label
+ * @channel_mask: echo channels of the group, bit N is channel N
+ * @timeout: echo timeout of the active cycle
+ * @window_cycles: cycles completed in the current rate window
+ * @done_mask: channels of the active cycle the engine has a sample of
+ * @burst_total: pings of the current burst, 1 outside burst mode
+ * @burst_left: pings of the current burst still to trigger
+ * @burst_start_ns: monotonic time of the first trigger of the burst
+ */
+struct trigger_group {
+    unsigned int trigger;
+    char        label[12];
+    unsigned long channel_mask;
+    struct hrtimer timeout;
+    unsigned int window_cycles;
+    unsigned long done_mask;
+    unsigned int burst_total;
+    unsigned int burst_left;
+    u64         burst_start_ns;
+};
 
-/* Timer struct, used to create an priodic timer */
-static struct timer_list schedule_timer;
-static struct timer_list distanceTimeoutTimer;
+static struct trigger_group groups[MAX_GROUPS];
+/* Scheduling state of the groups, see hcsr04_group_pick() */
+static struct hcsr04_group_sched group_sched[MAX_GROUPS];
 
-/* Define GPIOs for trigger pin */
-static struct gpio triggers[] = {
-        {  16, GPIOF_OUT_INIT_LOW, "Trigger" },
+/* Achieved rates over the last second, per group and in samples/s */
+static unsigned int group_rates[MAX_GROUPS];
+module_param_array(group_rates, uint, NULL, 0444);
+MODULE_PARM_DESC(group_rates, "Achieved measurement cycles per second, per group (read only)");
+static unsigned int aggregate_rate;
+module_param(aggregate_rate, uint, 0444);
+MODULE_PARM_DESC(aggregate_rate, "Achieved samples per second of all echoes (read only)");
+static u64 rate_window_start_ns;
+static unsigned int rate_window_samples;
+
+/*
+ * Per echo channel state. Each echo IRQ gets its own channel as dev_id, so the
+ * ISR never has to look up which pin fired or re-read its level.
+ * @index: channel index, echo number - 1
+ * @group: trigger group index
+ * @irq: assigned IRQ number of the echo pin
+ * @label: GPIO label
+ * @name: IRQ name shown in /proc/interrupts
+ * @high: current echo level, toggled on every edge
+ * @start_ns: monotonic time of the rising edge, 0 until seen in this cycle
+ * @end_ns: monotonic time of the falling edge or the timeout
+ * @flags: DUAL_HCSR04_FLAG_TIMEOUT if the echo timed out
+ * @filter_params: filter_params the filter was built with
+ * @filter: median and average of the valid distances
+ * @burst: valid pings of the current burst
+ * @latest: distance of the last published sample, for IIO
+ * @ring: samples from the engine thread to read(), HCSR04_RING_SIZE of them
+ */
+struct echo_channel {
+    int         index;
+    int         group;
+    int         irq;
+    char        label[12];
+    char        name[24];
+    bool        high;
+    u64         start_ns;
+    u64         end_ns;
+    u16         flags;
+    u32         filter_params;
+    struct hcsr04_filter filter;
+    struct hcsr04_burst burst;
+    s32         latest;
+    struct hcsr04_ring ring;
 };
 
-/* Define GPIOs for echo pins */
-static struct gpio echos[] = {
-        { 20, GPIOF_IN, "Echo 1" },
-        { 21, GPIOF_IN, "Echo 2" },
+static struct echo_channel channels[MAX_CHANNELS];
+
+/*
+ * Channel bitmaps, bit N is channel N.
+ * pending_mask: trigger fired, waiting for the echo to end or time out. Bits
+ *               are cleared atomically so only one of the ISR and the timeout
+ *               completes a channel.
+ * finished_mask: echo ended or timed out, sample is ready for the engine.
+ */
+static unsigned long pending_mask;
+static unsigned long finished_mask;
+
+/* Samples dropped because the reader fell behind, per echo */
+static unsigned long ring_overflows[MAX_CHANNELS];
+module_param_array(ring_overflows, ulong, NULL, 0444);
+MODULE_PARM_DESC(ring_overflows, "Samples dropped on full sample ring, per echo (read only)");
+/* Open files that read the sample rings, those that mapped the shared ring do not */
+static atomic_t ring_readers = ATOMIC_INIT(0);
+
+/*
+ * Raw edge capture, see DUAL_HCSR04_CONFIG_CAPTURE. Edges come from every echo
+ * IRQ, the echo timeouts and the engine, so producers take edge_lock; the
+ * consumer holds read_lock as well.
+ */
+static bool capture_edges;
+static struct dual_hcsr04_edge edge_ring[EDGE_RING_SIZE];
+static unsigned int edge_head;
+static unsigned int edge_tail;
+static bool edge_dropped;
+static DEFINE_SPINLOCK(edge_lock);
+static unsigned long edge_overflows;
+module_param(edge_overflows, ulong, 0444);
+MODULE_PARM_DESC(edge_overflows, "Raw edges dropped on full capture ring (read only)");
+
+/* Serializes readers, so each ring has exactly one consumer */
+static DEFINE_MUTEX(read_lock);
+
+/* Read format of newly opened files, DUAL_HCSR04_MODE_TEXT if set */
+static bool text_mode;
+module_param(text_mode, bool, 0644);
+MODULE_PARM_DESC(text_mode, "Open the device in text mode instead of binary records");
+
+/* Readers sleep here in poll() until new samples are published */
+static DECLARE_WAIT_QUEUE_HEAD(read_wait);
+
+/*
+ * Per open file state, in filp->private_data.
+ * @mode: read format, DUAL_HCSR04_MODE_*
+ * @mapped: the file has mapped the shared ring, poll() follows its head
+ * @cursor: shared ring head the consumer has read up to, set by mmap() and
+ *          DUAL_HCSR04_IOC_SET_CURSOR
+ */
+struct reader {
+    u32         mode;
+    bool        mapped;
+    u32         cursor;
 };
 
-/* Later on, the assigned IRQ numbers for the echos are stored here */
-static int echo_irqs[] = { -1, -1 };
+/* Shared sample ring mapped by mmap(): header page followed by the slots */
+static void *mmap_area;
+static struct dual_hcsr04_mmap_header *mmap_header;
+static struct dual_hcsr04_record *mmap_ring;
+static u32 mmap_head;
 
 static struct task_struct *runThreads[2];
-static bool threadStops[2] = {false, false};
 
-/* Frequence of sampling */
-static int sampl_frequence = 0;
+/* Measurement engine sleeps here until there is something to do */
+static DECLARE_WAIT_QUEUE_HEAD(engine_wait);
+
+/* Number of times the engine thread has been woken up */
+static unsigned long engine_wakeups;
+module_param(engine_wakeups, ulong, 0444);
+MODULE_PARM_DESC(engine_wakeups, "Number of measurement engine wakeups (read only)");
+
+/* Measurement configuration, changed under config_lock */
+static struct dual_hcsr04_config config = {
+    .rate = 0,
+    .max_range_mm = DEFAULT_RANGE,
+    .recovery_us = DEFAULT_RECOVERY,
+};
+static DEFINE_MUTEX(config_lock);
+
+/* Measuring in free run mode, see DUAL_HCSR04_CONFIG_FREE_RUN */
+static bool free_running;
+
+/* Echo timeout derived from config.max_range_mm */
+static unsigned int echo_timeout_us;
+
+/* Filter of the engine, config.filter_window | config.filter_alpha << 16 */
+static u32 filter_params;
+
+/*
+ * Per echo health statistics, kept per CPU so counting takes no lock and
+ * shares no cache line. Summed up when read through debugfs.
+ * @samples: pings completed, timed out or not
+ * @timeouts: pings without echo
+ * @glitches: pings with an echo end but no start
+ * @overflows: samples dropped on the full sample ring
+ * @latency_hist: time from the trigger to the echo start
+ * @width_hist: echo pulse width
+ * @cycle_hist: time from the trigger to the echo end or the timeout
+ *
+ * Histogram bucket 0 counts 0 ns, bucket N counts 2^(N-1) to 2^N - 1 ns.
+ */
+struct channel_stats {
+    unsigned long samples;
+    unsigned long timeouts;
+    unsigned long glitches;
+    unsigned long overflows;
+    unsigned long latency_hist[HIST_BUCKETS];
+    unsigned long width_hist[HIST_BUCKETS];
+    unsigned long cycle_hist[HIST_BUCKETS];
+};
+
+struct engine_stats {
+    struct channel_stats ch[MAX_CHANNELS];
+};
 
-/* Echo signals time */
-static struct timespec startEcho1, startEcho2, endEcho1, endEcho2;
+static struct engine_stats __percpu *stats;
+static u64 stats_reset_ns;
+static struct dentry *debugfs_dir;
 
-static uint distance1, distance2;
+/* Time from the first trigger of a burst to its published samples */
+static unsigned int burst_latency_us;
+module_param(burst_latency_us, uint, 0444);
+MODULE_PARM_DESC(burst_latency_us, "Latency of the last burst mode sample in us (read only)");
 
-/* Flags */
-static bool echo1Finished, echo2Finished, startMeasureDistance;
+/* Speed of sound for the configured air, see DUAL_HCSR04_CONFIG_COMPENSATE */
+static unsigned int sound_speed;
+module_param(sound_speed, uint, 0444);
+MODULE_PARM_DESC(sound_speed, "Speed of sound used for the distance in mm/s (read only)");
+
+/*
+ * hcsr04_distance() multiplier for sound_speed. Rebuilt when sound_speed
+ * changes, so converting a sample needs no division.
+ */
+static u32 distance_mult;
+
+/* Highest rate allowed by the current configuration */
+static unsigned int max_rate;
+module_param(max_rate, uint, 0444);
+MODULE_PARM_DESC(max_rate, "Highest sampling rate allowed by the current range and groups (read only)");
+
+/* Sampling tick jitter (actual - expected expiry), in nanoseconds */
+static unsigned long sched_jitter_last_ns;
+module_param(sched_jitter_last_ns, ulong, 0444);
+MODULE_PARM_DESC(sched_jitter_last_ns, "Jitter of the last sampling tick in ns (read only)");
+static unsigned long sched_jitter_max_ns;
+module_param(sched_jitter_max_ns, ulong, 0644);
+MODULE_PARM_DESC(sched_jitter_max_ns, "Maximum sampling tick jitter in ns, write 0 to reset");
+static unsigned long sched_overruns;
+module_param(sched_overruns, ulong, 0444);
+MODULE_PARM_DESC(sched_overruns, "Number of missed sampling ticks (read only)");
+
+/* Published samples and failed measurements */
+static unsigned long samples_published;
+module_param(samples_published, ulong, 0444);
+MODULE_PARM_DESC(samples_published, "Number of samples published (read only)");
+static unsigned long echo_timeouts;
+module_param(echo_timeouts, ulong, 0444);
+MODULE_PARM_DESC(echo_timeouts, "Number of echoes that timed out (read only)");
+static unsigned long echo_glitches;
+module_param(echo_glitches, ulong, 0444);
+MODULE_PARM_DESC(echo_glitches, "Number of echoes that ended without a start (read only)");
+
+/*
+ * Engine requests, bits of engine_flags. Timers set them and wake the engine,
+ * which clears them as it handles them.
+ * ENGINE_MEASURE: start a sampling round
+ * ENGINE_QUIET_GAP: a quiet gap is over, schedule the waiting groups
+ */
+#define ENGINE_MEASURE      (0)
+#define ENGINE_QUIET_GAP    (1)
+static unsigned long engine_flags;
 
 /* Character device structure */
 static int      raspi_gpio_open (   struct inode *inode,
@@ -69,6 +363,13 @@ static ssize_t  raspi_gpio_write (  struct file *filp,
                                     loff_t *f_pos);
 static int      raspi_gpio_release (struct inode *inode,
                                     struct file *filp);
+static int      raspi_gpio_mmap (   struct file *filp,
+                                    struct vm_area_struct *vma);
+static unsigned int raspi_gpio_poll (struct file *filp,
+                                    poll_table *wait);
+static long     raspi_gpio_ioctl (  struct file *filp,
+                                    unsigned int cmd,
+                                    unsigned long arg);
 /* File operation structure */
 static struct file_operations raspi_gpio_fops = {
                                                     .owner = THIS_MODULE,
@@ -76,39 +377,157 @@ static struct file_operations raspi_gpio_fops = {
                                                     .release = raspi_gpio_release,
                                                     .read = raspi_gpio_read,
                                                     .write = raspi_gpio_write,
+                                                    .mmap = raspi_gpio_mmap,
+                                                    .poll = raspi_gpio_poll,
+                                                    .unlocked_ioctl = raspi_gpio_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+                                                    .compat_ioctl = compat_ptr_ioctl,
+#else
+                                                    .compat_ioctl = raspi_gpio_ioctl,
+#endif
+                                                };
+
+/* IIO device, registered next to the character device when the kernel has IIO */
+#if IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+static int      raspi_iio_read_raw (struct iio_dev *indio_dev,
+                                    struct iio_chan_spec const *chan,
+                                    int *val,
+                                    int *val2,
+                                    long mask);
+static const struct iio_info raspi_iio_info = {
+                                                    .read_raw = raspi_iio_read_raw,
                                                 };
+static struct iio_chan_spec iio_channels[MAX_CHANNELS + 1];
+static struct iio_dev *raspi_iio_dev;
+static struct iio_trigger *iio_trig;
+#endif
+static void     raspi_iio_poll(void);
+/*
+ * Switch the conversion to a new speed of sound in mm/s.
+ */
+static void set_sound_speed(unsigned int speed) {
+    if (speed == sound_speed)
+        return;
+    WRITE_ONCE(distance_mult, hcsr04_distance_mult(speed));
+    sound_speed = speed;
+}
+
+/*
+ * Push one sample into the channel ring. Only called by the engine thread.
+ * A full ring drops the new sample and counts an overflow, unless nobody
+ * reads the rings: mapped files leave them full for good.
+ */
+static void sample_ring_push(int index, const struct dual_hcsr04_record *rec)
+{
+    if (!hcsr04_ring_push(&channels[index].ring, rec) && atomic_read(&ring_readers)) {
+        ring_overflows[index]++;
+        this_cpu_inc(stats->ch[index].overflows);
+    }
+}
+/*
+ * Check whether the channel ring has unread samples.
+ */
+static bool sample_ring_empty(struct echo_channel *ch)
+{
+    return hcsr04_ring_empty(&ch->ring);
+}
+/*
+ * Get the oldest unread sample without removing it. Caller holds read_lock.
+ */
+static bool sample_ring_peek(struct echo_channel *ch, struct dual_hcsr04_record *rec)
+{
+    return hcsr04_ring_peek(&ch->ring, rec);
+}
+/*
+ * Release the sample returned by sample_ring_peek(). Caller holds read_lock.
+ */
+static void sample_ring_consume(struct echo_channel *ch)
+{
+    hcsr04_ring_consume(&ch->ring);
+}
+
 /*
- * Calculate diferent of two time struct, return microsecond
+ * Publish one sample to the shared mmap ring. Only called by the engine
+ * thread. The slot is written before head is advanced, so a consumer that
+ * sees the new head also sees the sample.
  */
-static long time_diff (struct timespec *t1, struct timespec *t2) {
-    int sec = t1->tv_sec - t2->tv_sec;
-    long nsec = t1->tv_nsec - t2->tv_nsec;
+static void mmap_ring_push(const struct dual_hcsr04_record *rec)
+{
+    // The previous head, which tells a consumer this slot is being
+    // overwritten, must be visible before any byte of the slot changes
+    smp_wmb();
+    mmap_ring[mmap_head & (MMAP_RING_SIZE - 1)] = *rec;
+    mmap_head++;
+    smp_store_release(&mmap_header->head, mmap_head);
+}
 
-    return sec * 1000000 + nsec/1000;
+/*
+ * Update the last sample of a channel in the shared header. Only called by
+ * the engine thread; the sequence count is part of the mmap ABI, so it is a
+ * plain u32 rather than a seqcount_t. Readers retry instead of blocking the
+ * writer, and preemption is off so they never spin on a preempted update.
+ */
+static void latest_publish(int index, const struct dual_hcsr04_record *rec)
+{
+    struct dual_hcsr04_latest_slot *slot = &mmap_header->latest[index];
+
+    preempt_disable();
+    WRITE_ONCE(slot->seq, slot->seq + 1);
+    smp_wmb();
+    slot->record = *rec;
+    smp_wmb();
+    WRITE_ONCE(slot->seq, slot->seq + 1);
+    preempt_enable();
 }
 /*
- * Calculate the distance of sensor.
+ * Copy the last sample of a channel without taking any lock.
  */
-static uint calculate_distance(uint echoNum, bool isTimedOut) {
-    uint res = -1;
-    long usec = 0;
-    struct timespec *tend, *tstart;
+static void latest_read(int index, struct dual_hcsr04_record *rec)
+{
+    const struct dual_hcsr04_latest_slot *slot = &mmap_header->latest[index];
+    u32 seq;
+
+    do {
+        seq = READ_ONCE(slot->seq);
+        smp_rmb();
+        *rec = slot->record;
+        smp_rmb();
+    } while ((seq & 1) || seq != READ_ONCE(slot->seq));
+}
 
-    if (echoNum == 1) {
-        tend = &endEcho1;
-        tstart = &startEcho1;
-    } else {
-        tend = &endEcho2;
-        tstart = &startEcho2;
-    }
+/*
+ * Record a raw edge if capture is on. Called from the echo IRQs, the echo
+ * timeouts and the engine thread. A full ring drops the new edge.
+ */
+static void edge_capture(int type, int index, u64 now)
+{
+    struct dual_hcsr04_edge *edge;
+    unsigned long irqflags;
 
-    if (!isTimedOut) {
-        // calculate
-        usec = time_diff(tend, tstart);
-        res = (usec * 1750) / 1000000;
+    if (!READ_ONCE(capture_edges))
+        return;
+    spin_lock_irqsave(&edge_lock, irqflags);
+    if (CIRC_SPACE(edge_head, edge_tail, EDGE_RING_SIZE) == 0) {
+        edge_overflows++;
+        edge_dropped = true;
+    } else {
+        edge = &edge_ring[edge_head];
+        edge->timestamp_ns = now;
+        edge->type = type;
+        edge->index = index;
+        edge->flags = edge_dropped ? DUAL_HCSR04_EDGE_FLAG_OVERFLOW : 0;
+        edge->reserved = 0;
+        edge_dropped = false;
+        edge_head = (edge_head + 1) & (EDGE_RING_SIZE - 1);
     }
-
-    return res;
+    spin_unlock_irqrestore(&edge_lock, irqflags);
+}
+/*
+ * Check whether the capture ring has unread edges.
+ */
+static bool edge_ring_empty(void)
+{
+    return CIRC_CNT(READ_ONCE(edge_head), READ_ONCE(edge_tail), EDGE_RING_SIZE) == 0;
 }
 
 /*
@@ -116,176 +535,1031 @@ static uint calculate_distance(uint echoNum, bool isTimedOut) {
  */
 static irqreturn_t echo_isr(int irq, void *data)
 {
-    if(irq == echo_irqs[0] && gpio_get_value(echos[0].gpio)) {
-        // Echo 1 started
-        getnstimeofday(&startEcho1);
-    } else if(irq == echo_irqs[0] && !gpio_get_value(echos[0].gpio)) {
-        // Echo 1 ended
-        getnstimeofday(&endEcho1);
-        // Calculate the distance
-        distance1 = calculate_distance(1, false);
+    u64 now = ktime_get_ns();
+    struct echo_channel *ch = data;
+
+    ch->high = !ch->high;
+    trace_dual_hcsr04_edge(ch->index + 1, ch->high, now);
+    edge_capture(ch->high ? DUAL_HCSR04_EDGE_RISING : DUAL_HCSR04_EDGE_FALLING, ch->index + 1, now);
+    if (ch->high) {
+        // Echo started
+        ch->start_ns = now;
+    } else if (test_and_clear_bit(ch->index, &pending_mask)) {
+        // Echo ended, the engine calculates the distance
+        ch->end_ns = now;
+        ch->flags = 0;
         // set the flag.
-        echo1Finished = true;
-    }
-    if(irq == echo_irqs[1] && gpio_get_value(echos[1].gpio)) {
-        // Echo 2 started
-        getnstimeofday(&startEcho2);
-    } else if(irq == echo_irqs[1] && !gpio_get_value(echos[1].gpio)) {
-        // Echo 2 ended
-        getnstimeofday(&endEcho2);
-        // Calculate the distance
-        distance2 = calculate_distance(2, false);
-        // set the flag.
-        echo2Finished = true;
+        smp_mb__before_atomic();
+        set_bit(ch->index, &finished_mask);
+        wake_up(&engine_wait);
     }
 
     return IRQ_HANDLED;
 }
 
 /*
- * Echo signal is timed out
+ * Echo signal of a trigger group is timed out
  */
-static void echo_timeout(unsigned long data)
+static enum hrtimer_restart echo_timeout(struct hrtimer *timer)
 {
-    printk(KERN_INFO "%s\n", __func__);
+    struct trigger_group *grp = container_of(timer, struct trigger_group, timeout);
+    unsigned long timedout = 0;
+    u64 now = ktime_get_ns();
+    int i;
 
-    if (!echo1Finished) {
-        distance1 = calculate_distance(1, true);
-        // set the flag.
-        echo1Finished = true;
+    for_each_set_bit(i, &grp->channel_mask, num_channels) {
+        if (test_and_clear_bit(i, &pending_mask)) {
+            channels[i].end_ns = now;
+            channels[i].flags = DUAL_HCSR04_FLAG_TIMEOUT;
+            timedout |= BIT(i);
+            trace_dual_hcsr04_timeout(i + 1, now);
+            edge_capture(DUAL_HCSR04_EDGE_TIMEOUT, i + 1, now);
+        }
     }
-    if (!echo2Finished) {
-        distance2 = calculate_distance(2, true);
-        // set the flag.
-        echo2Finished = true;
+    // set the flags.
+    smp_mb__before_atomic();
+    for_each_set_bit(i, &timedout, num_channels)
+        set_bit(i, &finished_mask);
+    wake_up(&engine_wait);
+
+    return HRTIMER_NORESTART;
+}
+/*
+ * End of a quiet gap between trigger groups
+ */
+static enum hrtimer_restart gap_timer_function(struct hrtimer *timer)
+{
+    set_bit(ENGINE_QUIET_GAP, &engine_flags);
+    wake_up(&engine_wait);
+
+    return HRTIMER_NORESTART;
+}
+/*
+ * Convert the edges recorded for a finished channel into a sample record.
+ * Runs in the engine thread, so the hard IRQ only takes timestamps.
+ */
+static void channel_to_record(struct echo_channel *ch, struct dual_hcsr04_record *rec)
+{
+    hcsr04_echo_record(rec, ch->index + 1, ch->start_ns, ch->end_ns, ch->flags,
+                       READ_ONCE(distance_mult));
+}
+/*
+ * Run a sample through the channel filter, see hcsr04_filter_apply(). Runs in
+ * the engine thread and uses the fixed storage of the channel.
+ */
+static void channel_filter(struct echo_channel *ch, struct dual_hcsr04_record *rec)
+{
+    u32 params = READ_ONCE(filter_params);
+    unsigned int window = params & 0xffff;
+    unsigned int alpha = params >> 16;
+
+    if (params != ch->filter_params) {
+        // Filter changed, start over
+        ch->filter_params = params;
+        hcsr04_filter_reset(&ch->filter);
     }
-    del_timer_sync(&distanceTimeoutTimer);
+    hcsr04_filter_apply(&ch->filter, window, alpha, rec);
+}
+static unsigned int hist_bucket(u64 ns)
+{
+    return min(fls64(ns), HIST_BUCKETS - 1);
 }
 /*
- * Get distance thread. This thread always get distance value from dual HC-SR04
- * sensors.
+ * Count a finished ping in the statistics of its channel.
  */
-static int get_distance_thread(void *data)
+static void stats_ping(struct echo_channel *ch, const struct dual_hcsr04_record *rec)
 {
-    printk (KERN_INFO "Get distance thread start.");
-    while(!threadStops[0]) {
-        if (startMeasureDistance) {
-            startMeasureDistance = false;
-            // Set trigger pin in 2us
-            gpio_set_value(triggers[0].gpio, 1);
-            udelay(2);
-            gpio_set_value(triggers[0].gpio, 0);
-            // Start timeout timer
-            distanceTimeoutTimer.function = echo_timeout;
-            distanceTimeoutTimer.data = 0L;
-            distanceTimeoutTimer.expires = jiffies + (sampl_frequence*HZ);         // 30 ms @TODO calculate the sampl_freq
-            add_timer(&distanceTimeoutTimer);
+    struct channel_stats __percpu *cs = &stats->ch[ch->index];
+    u64 trigger_ns = group_sched[ch->group].start_ns;
+
+    this_cpu_inc(cs->samples);
+    this_cpu_inc(cs->cycle_hist[hist_bucket(ch->end_ns - trigger_ns)]);
+    if (rec->flags & DUAL_HCSR04_FLAG_TIMEOUT) {
+        this_cpu_inc(cs->timeouts);
+    } else if (rec->flags & DUAL_HCSR04_FLAG_GLITCH) {
+        this_cpu_inc(cs->glitches);
+    } else {
+        this_cpu_inc(cs->latency_hist[hist_bucket(ch->start_ns - trigger_ns)]);
+        this_cpu_inc(cs->width_hist[hist_bucket(rec->width_ns)]);
+    }
+}
+/*
+ * Filter a finished sample and publish it to the channel ring and the shared
+ * ring. Only called by the engine thread.
+ */
+static void publish_record(struct dual_hcsr04_record *rec)
+{
+    int i = rec->channel - 1;
+
+    channel_filter(&channels[i], rec);
+    WRITE_ONCE(channels[i].latest, rec->distance);
+    sample_ring_push(i, rec);
+    mmap_ring_push(rec);
+    latest_publish(i, rec);
+    trace_dual_hcsr04_publish(rec);
+    samples_published++;
+    rate_window_samples++;
+}
+/*
+ * Wake-up condition of the measurement engine.
+ */
+static bool engine_has_work(void)
+{
+    return READ_ONCE(engine_flags) || READ_ONCE(finished_mask) ||
+           kthread_should_stop();
+}
+/*
+ * Fire the trigger of a group and arm its echo timeout.
+ */
+static void trigger_group_start(int index, u64 now)
+{
+    struct trigger_group *grp = &groups[index];
+    unsigned long busy = 0;
+    int i;
+
+    // Resync edge tracking. An echo still high is waiting out a missed echo
+    // (about 38 ms, longer than short range timeouts) and will not measure.
+    for_each_set_bit(i, &grp->channel_mask, num_channels) {
+        channels[i].high = gpio_get_value(echos[i].gpio);
+        channels[i].start_ns = 0;
+        if (channels[i].high)
+            busy |= BIT(i);
+    }
+    if (!grp->burst_left) {
+        // New burst, or a single ping outside burst mode
+        grp->burst_total = clamp_t(u32, READ_ONCE(config.burst_count), 1, DUAL_HCSR04_BURST_MAX);
+        grp->burst_left = grp->burst_total;
+        grp->burst_start_ns = now;
+        for_each_set_bit(i, &grp->channel_mask, num_channels)
+            hcsr04_burst_reset(&channels[i].burst);
+    }
+    grp->burst_left--;
+    grp->done_mask = 0;
+    // Before any echo of this cycle can be captured
+    edge_capture(DUAL_HCSR04_EDGE_TRIGGER, index, now);
+    smp_mb__before_atomic();
+    for_each_set_bit(i, &grp->channel_mask, num_channels) {
+        if (!(busy & BIT(i)))
+            set_bit(i, &pending_mask);
+    }
+
+    group_sched[index].due = false;
+    group_sched[index].active = true;
+    group_sched[index].start_ns = now;
+    gpio_set_value(grp->trigger, 1);
+    udelay(TRIGGER_PULSE);
+    gpio_set_value(grp->trigger, 0);
+    trace_dual_hcsr04_trigger(index, now);
+    // Busy echoes are done right away, their late falling edge is ignored
+    for_each_set_bit(i, &busy, num_channels) {
+        channels[i].end_ns = now;
+        channels[i].flags = DUAL_HCSR04_FLAG_TIMEOUT | DUAL_HCSR04_FLAG_BUSY;
+        edge_capture(DUAL_HCSR04_EDGE_BUSY, i + 1, now);
+        set_bit(i, &finished_mask);
+    }
+    // Echoes must come back within the maximum range
+    hrtimer_start(&grp->timeout, ns_to_ktime((u64)READ_ONCE(echo_timeout_us) * NSEC_PER_USEC),
+                  HRTIMER_MODE_REL);
+}
+/*
+ * Finish the cycle of every active group whose samples are all in. The last
+ * cycle of a burst publishes the burst samples, the others trigger the next
+ * ping once the sensors have recovered.
+ */
+static void trigger_groups_complete(u64 now)
+{
+    struct dual_hcsr04_record rec;
+    int g, i;
+
+    for (g = 0; g < num_groups; g++) {
+        struct trigger_group *grp = &groups[g];
+        struct hcsr04_group_sched *sched = &group_sched[g];
+
+        if (!sched->active || grp->done_mask != grp->channel_mask)
+            continue;
+        /*
+         * All echoes are back, the timeout is not needed anymore. A timeout
+         * still running would time out the echoes of the next cycle if the
+         * group re-triggered now, so wait for it; the engine may sleep.
+         */
+        hrtimer_cancel(&grp->timeout);
+        sched->active = false;
+        sched->quiet_until_ns = now + (u64)READ_ONCE(config.quiet_gap_us) * NSEC_PER_USEC;
+        grp->window_cycles++;
+        if (grp->burst_left) {
+            sched->due = true;
+            sched->recover_until_ns = now + (u64)READ_ONCE(config.recovery_us) * NSEC_PER_USEC;
+            continue;
+        }
+        if (grp->burst_total > 1) {
+            bool median = READ_ONCE(config.flags) & DUAL_HCSR04_CONFIG_BURST_MEDIAN;
+
+            for_each_set_bit(i, &grp->channel_mask, num_channels) {
+                hcsr04_burst_record(&channels[i].burst, i + 1, channels[i].end_ns, median, &rec);
+                publish_record(&rec);
+            }
+            burst_latency_us = div_u64(now - grp->burst_start_ns, NSEC_PER_USEC);
         }
-        if (echo1Finished) {
-            echo1Finished = false;
-            // process distance 1 value
-            printk(KERN_INFO "distance1: %d\n", distance1);
+        // Free run, measure again as soon as the sensors have recovered
+        if (READ_ONCE(free_running)) {
+            sched->due = true;
+            sched->recover_until_ns = now + (u64)READ_ONCE(config.recovery_us) * NSEC_PER_USEC;
         }
-        if (echo2Finished) {
-            echo2Finished = false;
-            // process distance 2 value
-            printk(KERN_INFO "distance2: %d\n", distance2);
+    }
+}
+/*
+ * Trigger every due group that no active or still quiet group can hear. Groups
+ * that do not hear each other start together, groups that do take turns. If a
+ * group only waits for a quiet gap, the gap timer wakes the engine up when it
+ * is over.
+ */
+static void trigger_groups_schedule(u64 now)
+{
+    u64 wake_ns;
+    int g;
+
+    while ((g = hcsr04_group_pick(group_sched, num_groups, now, &wake_ns)) >= 0)
+        trigger_group_start(g, now);
+    if (wake_ns)
+        hrtimer_start(&gap_timer, ns_to_ktime(wake_ns), HRTIMER_MODE_ABS);
+}
+/*
+ * Refresh the achieved rates once per second.
+ */
+static void update_rates(u64 now)
+{
+    u64 elapsed = now - rate_window_start_ns;
+    int g;
+
+    if (elapsed < NSEC_PER_SEC)
+        return;
+    for (g = 0; g < num_groups; g++) {
+        group_rates[g] = div64_u64((u64)groups[g].window_cycles * NSEC_PER_SEC + elapsed / 2, elapsed);
+        groups[g].window_cycles = 0;
+    }
+    aggregate_rate = div64_u64((u64)rate_window_samples * NSEC_PER_SEC + elapsed / 2, elapsed);
+    rate_window_samples = 0;
+    rate_window_start_ns = now;
+}
+/*
+ * Get distance thread. This thread sleeps until a measurement is requested,
+ * an echo ISR/timeout completes or a quiet gap is over, then gets distance
+ * values from the HC-SR04 sensors and triggers the next groups.
+ */
+static int get_distance_thread(void *data)
+{
+    unsigned long done, published;
+    u64 now;
+    int i;
+
+    printk (KERN_INFO "Get distance thread start.");
+    while(!kthread_should_stop()) {
+        wait_event_interruptible(engine_wait, engine_has_work());
+        engine_wakeups++;
+        clear_bit(ENGINE_QUIET_GAP, &engine_flags);
+
+        published = samples_published;
+        done = xchg(&finished_mask, 0);
+        for_each_set_bit(i, &done, num_channels) {
+            struct trigger_group *grp = &groups[channels[i].group];
+            struct dual_hcsr04_record rec;
+
+            channel_to_record(&channels[i], &rec);
+            stats_ping(&channels[i], &rec);
+            if (rec.flags & DUAL_HCSR04_FLAG_TIMEOUT)
+                echo_timeouts++;
+            if (rec.flags & DUAL_HCSR04_FLAG_GLITCH)
+                echo_glitches++;
+            grp->done_mask |= BIT(i);
+            if (grp->burst_total > 1)
+                hcsr04_burst_ping(&channels[i].burst, &rec);
+            else
+                publish_record(&rec);
         }
 
-        /* Delay 1 microsecond */
-        udelay(1);
+        now = ktime_get_ns();
+        trigger_groups_complete(now);
+        if (samples_published != published)
+            raspi_iio_poll();
+        if (samples_published != published || !edge_ring_empty())
+            wake_up_interruptible(&read_wait);
+        if (test_and_clear_bit(ENGINE_MEASURE, &engine_flags)) {
+            // New sampling round, every group with echoes measures once
+            for (i = 0; i < num_groups; i++) {
+                if (group_sched[i].due || group_sched[i].active)
+                    sched_overruns++;
+                else if (groups[i].channel_mask)
+                    group_sched[i].due = true;
+            }
+        }
+        trigger_groups_schedule(now);
+        update_rates(now);
     }
     return 0;
 }
 
 static int      raspi_gpio_open(struct inode *inode, struct file *filp) {
+    struct reader *r;
+
+    r = kzalloc(sizeof(*r), GFP_KERNEL);
+    if (!r)
+        return -ENOMEM;
+    r->mode = text_mode ? DUAL_HCSR04_MODE_TEXT : DUAL_HCSR04_MODE_BINARY;
+    filp->private_data = r;
+    atomic_inc(&ring_readers);
     try_module_get(THIS_MODULE);
 
     return 0;
 }
+/*
+ * Drain the sample rings as text, one "<echo> <timestamp_ns> <distance>"
+ * line per sample, in mm or um (DUAL_HCSR04_CONFIG_MICROMETRE), -1 on
+ * timeout. Only whole lines are returned.
+ */
+static ssize_t  read_text (char *buf, size_t count) {
+    char line[48];
+    struct dual_hcsr04_record rec;
+    bool micrometre = READ_ONCE(config.flags) & DUAL_HCSR04_CONFIG_MICROMETRE;
+    ssize_t copied = 0;
+    bool more = true;
+    s64 distance;
+    int len, i;
+
+    while (more) {
+        more = false;
+        for (i = 0; i < num_channels; i++) {
+            if (!sample_ring_peek(&channels[i], &rec))
+                continue;
+            if (rec.flags & DUAL_HCSR04_FLAG_TIMEOUT)
+                distance = -1;
+            else if (micrometre)
+                distance = ((s64)rec.distance * 1000) >> DUAL_HCSR04_DISTANCE_SHIFT;
+            else
+                distance = rec.distance >> DUAL_HCSR04_DISTANCE_SHIFT;
+            len = scnprintf(line, sizeof(line), "%d %llu %lld\n", rec.channel, rec.timestamp_ns, distance);
+            if (copied + len > count)
+                return copied;
+            if (copy_to_user(buf + copied, line, len))
+                return copied ? copied : -EFAULT;
+            sample_ring_consume(&channels[i]);
+            copied += len;
+            more = true;
+        }
+    }
+
+    return copied;
+}
+/*
+ * Drain the sample rings as struct dual_hcsr04_record, copied to user in
+ * batches of READ_BATCH. Only whole records are returned.
+ */
+static ssize_t  read_records (char *buf, size_t count) {
+    struct dual_hcsr04_record batch[READ_BATCH];
+    size_t max = count / sizeof(batch[0]);
+    ssize_t copied = 0;
+    int n, i;
+
+    while (max) {
+        /* Fill a batch round robin, so no echo starves the others */
+        for (n = 0; n < READ_BATCH && n < max; ) {
+            int start = n;
+
+            for (i = 0; i < num_channels && n < READ_BATCH && n < max; i++) {
+                if (sample_ring_peek(&channels[i], &batch[n])) {
+                    sample_ring_consume(&channels[i]);
+                    n++;
+                }
+            }
+            if (n == start)
+                break;
+        }
+        if (n == 0)
+            break;
+        /* Samples are consumed already, a fault here loses this batch */
+        if (copy_to_user(buf + copied, batch, n * sizeof(batch[0])))
+            return copied ? copied : -EFAULT;
+        copied += n * sizeof(batch[0]);
+        max -= n;
+    }
+
+    return copied;
+}
+/*
+ * Drain the capture ring as struct dual_hcsr04_edge, copied to user in
+ * batches of READ_BATCH. Only whole edges are returned.
+ */
+static ssize_t  read_edges (char *buf, size_t count) {
+    struct dual_hcsr04_edge batch[READ_BATCH];
+    size_t max = count / sizeof(batch[0]);
+    ssize_t copied = 0;
+    int n;
+
+    while (max) {
+        spin_lock_irq(&edge_lock);
+        for (n = 0; n < READ_BATCH && n < max && edge_tail != edge_head; n++) {
+            batch[n] = edge_ring[edge_tail];
+            edge_tail = (edge_tail + 1) & (EDGE_RING_SIZE - 1);
+        }
+        spin_unlock_irq(&edge_lock);
+        if (n == 0)
+            break;
+        /* Edges are consumed already, a fault here loses this batch */
+        if (copy_to_user(buf + copied, batch, n * sizeof(batch[0])))
+            return copied ? copied : -EFAULT;
+        copied += n * sizeof(batch[0]);
+        max -= n;
+    }
+
+    return copied;
+}
+/*
+ * Something to read in the given mode: unread samples in any echo ring, or in
+ * edge mode unread edges in the capture ring.
+ */
+static bool read_ready(u32 mode)
+{
+    int i;
+
+    if (mode == DUAL_HCSR04_MODE_EDGES)
+        return !edge_ring_empty();
+    for (i = 0; i < num_channels; i++) {
+        if (!sample_ring_empty(&channels[i]))
+            return true;
+    }
+
+    return false;
+}
+/*
+ * Drain the sample rings in the file's read mode. Unread samples stay in the
+ * rings for the next read. Blocks until something is there, unless the file
+ * is non-blocking.
+ */
 static ssize_t  raspi_gpio_read (   struct file *filp,
                                     char *buf,
                                     size_t count,
                                     loff_t *f_pos){
-    char tmp[100] = "DEMO READ\n";
-    ssize_t i;
-
-    for (i=0; i<strlen(tmp); ++i) {
-        if (put_user(tmp[i], buf + i))
-            break;
+    struct reader *r = filp->private_data;
+    u32 mode = READ_ONCE(r->mode);
+    ssize_t ret;
+
+    for (;;) {
+        if (mutex_lock_interruptible(&read_lock))
+            return -ERESTARTSYS;
+
+        if (mode == DUAL_HCSR04_MODE_TEXT)
+            ret = read_text(buf, count);
+        else if (mode == DUAL_HCSR04_MODE_EDGES)
+            ret = read_edges(buf, count);
+        else
+            ret = read_records(buf, count);
+
+        mutex_unlock(&read_lock);
+
+        if (ret)
+            return ret;
+        // Data is there but not even one record, edge or line fits
+        if (read_ready(mode))
+            return -EINVAL;
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(read_wait, read_ready(mode)))
+            return -ERESTARTSYS;
     }
-    put_user(0, buf + i);
-
-    return i;
 }
-static void measure_timer_function(unsigned long data)
+/*
+ * Sampling tick. Re-armed on absolute deadlines so the period does not drift,
+ * and every tick starts a new trigger cycle.
+ */
+static enum hrtimer_restart measure_timer_function(struct hrtimer *timer)
 {
-    printk(KERN_INFO "%s\n", __func__);
+    ktime_t now = ktime_get();
+    s64 jitter = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(timer)));
+    u64 overruns;
+
+    if (jitter < 0)
+        jitter = -jitter;
+    sched_jitter_last_ns = jitter;
+    if (jitter > sched_jitter_max_ns)
+        sched_jitter_max_ns = jitter;
+
+    // Start measurement
+    set_bit(ENGINE_MEASURE, &engine_flags);
+    wake_up(&engine_wait);
 
     /* schedule next execution */
-    schedule_timer.expires = jiffies + (sampl_frequence*HZ);         // 1 sec.
-    add_timer(&schedule_timer);
+    overruns = hrtimer_forward(timer, now, schedule_period);
+    if (overruns > 1)
+        sched_overruns += overruns - 1;
+
+    return HRTIMER_RESTART;
 }
 static void raspi_update_timer(void) {
-    if (sampl_frequence == 0) {
-        /* Cancel the timer */
-        del_timer_sync(&schedule_timer);
+    hrtimer_cancel(&schedule_timer);
+    WRITE_ONCE(free_running, config.rate && (config.flags & DUAL_HCSR04_CONFIG_FREE_RUN));
+    if (config.rate == 0) {
         printk(KERN_INFO "Stop schedule timer.");
         return;
     }
-    schedule_timer.function = measure_timer_function;
-    schedule_timer.data = 0L;
-    schedule_timer.expires = jiffies + (sampl_frequence*HZ);         // 1 sec.
-    add_timer(&schedule_timer);
+    if (free_running) {
+        // One round to start, groups re-trigger themselves from then on
+        set_bit(ENGINE_MEASURE, &engine_flags);
+        wake_up(&engine_wait);
+        return;
+    }
+    schedule_period = ktime_set(0, NSEC_PER_SEC / config.rate);
+    hrtimer_start(&schedule_timer, schedule_period, HRTIMER_MODE_REL);
+}
+/*
+ * Speed of sound in mm/s for the configured air. Only runs when the
+ * configuration changes.
+ */
+static unsigned int config_sound_speed(const struct dual_hcsr04_config *cfg) {
+    if (!(cfg->flags & DUAL_HCSR04_CONFIG_COMPENSATE))
+        return HCSR04_SOUND_SPEED;
+    return hcsr04_sound_speed(cfg->temperature_mc, cfg->humidity_pct);
+}
+/*
+ * Echo timeout for max_range_mm: the time until the echo starts plus the
+ * time of flight there and back, in us. About 23 ms for 4 m, 6 ms for 1 m.
+ */
+static unsigned int range_to_timeout_us(u32 max_range_mm, unsigned int speed) {
+    return ECHO_START_DELAY + div_u64((u64)max_range_mm * 2 * USEC_PER_SEC, speed);
+}
+/*
+ * Highest sampling rate at which every group is done before the next tick,
+ * even when all groups run one after another.
+ */
+static unsigned int config_max_rate(const struct dual_hcsr04_config *cfg, unsigned int timeout_us) {
+    unsigned int pings = max(cfg->burst_count, 1u);
+    unsigned int rate = USEC_PER_SEC / (num_groups * (timeout_us + cfg->quiet_gap_us +
+                                        (pings - 1) * (timeout_us + cfg->recovery_us)));
+
+    if (!(cfg->flags & DUAL_HCSR04_CONFIG_SHORT_RANGE))
+        rate = min(rate, (unsigned int)MAXIMUM_RATE);
+    return rate;
+}
+/*
+ * Validate and apply a new configuration. Caller holds config_lock.
+ */
+static int apply_config(const struct dual_hcsr04_config *cfg) {
+    unsigned int timeout_us, rate, speed;
+    bool timer_changed;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(cfg->reserved); i++) {
+        if (cfg->reserved[i])
+            return -EINVAL;
+    }
+    if (cfg->max_range_mm < MINIMUM_RANGE || cfg->max_range_mm > MAXIMUM_RANGE)
+        return -EINVAL;
+    if (cfg->quiet_gap_us > MAXIMUM_QUIET_GAP || cfg->recovery_us > MAXIMUM_QUIET_GAP)
+        return -EINVAL;
+    if (cfg->flags & ~(DUAL_HCSR04_CONFIG_FREE_RUN | DUAL_HCSR04_CONFIG_SHORT_RANGE |
+                       DUAL_HCSR04_CONFIG_COMPENSATE | DUAL_HCSR04_CONFIG_MICROMETRE |
+                       DUAL_HCSR04_CONFIG_BURST_MEDIAN | DUAL_HCSR04_CONFIG_CAPTURE))
+        return -EINVAL;
+    if (cfg->burst_count > DUAL_HCSR04_BURST_MAX)
+        return -EINVAL;
+    if (cfg->filter_window > DUAL_HCSR04_FILTER_WINDOW_MAX ||
+        (cfg->filter_window > 1 && !(cfg->filter_window & 1)) ||
+        cfg->filter_alpha > DUAL_HCSR04_FILTER_ALPHA_ONE)
+        return -EINVAL;
+    if (cfg->temperature_mc < DUAL_HCSR04_TEMPERATURE_MIN ||
+        cfg->temperature_mc > DUAL_HCSR04_TEMPERATURE_MAX ||
+        cfg->humidity_pct > DUAL_HCSR04_HUMIDITY_MAX)
+        return -EINVAL;
+    speed = config_sound_speed(cfg);
+    if (!speed || speed > HCSR04_SOUND_SPEED_MAX)
+        return -EINVAL;
+    timeout_us = range_to_timeout_us(cfg->max_range_mm, speed);
+    rate = config_max_rate(cfg, timeout_us);
+    if (!(cfg->flags & DUAL_HCSR04_CONFIG_FREE_RUN) && cfg->rate > rate)
+        return -EINVAL;
+
+    timer_changed = cfg->rate != config.rate || cfg->flags != config.flags;
+    WRITE_ONCE(echo_timeout_us, timeout_us);
+    set_sound_speed(speed);
+    WRITE_ONCE(filter_params, cfg->filter_window | cfg->filter_alpha << 16);
+    WRITE_ONCE(capture_edges, !!(cfg->flags & DUAL_HCSR04_CONFIG_CAPTURE));
+    max_rate = rate;
+    config = *cfg;
+    if (timer_changed)
+        raspi_update_timer();
+
+    return 0;
 }
+/*
+ * Set the sampling frequence from a decimal number, e.g. "echo 10 >".
+ */
 static ssize_t  raspi_gpio_write (  struct file *filp,
                                     const char *buf,
                                     size_t count,
                                     loff_t *f_pos) {
-    char tmp[100];
-    long rate;
-    int maxbytes; /*maximum bytes that can be read from f_pos to BUFFER_SIZE*/
-    int bytes_to_write; /* gives the number of bytes to write*/
-    int bytes_writen;/*number of bytes actually writen*/
+    struct dual_hcsr04_config cfg;
+    unsigned int rate;
     int res;
 
-    memset(tmp, 0, 100);
-    maxbytes = 100 - *f_pos;
-    if(maxbytes > count)
-        bytes_to_write = count;
-    else
-        bytes_to_write = maxbytes;
-    bytes_writen = bytes_to_write - copy_from_user(tmp + *f_pos, buf, bytes_to_write);
-    *f_pos += bytes_writen;
-
-    if (IS_ERR(tmp))
-        return PTR_ERR(tmp);
-    printk(KERN_INFO "Write requested: %d - [%s]", count, tmp);
-
-    res = kstrtol(tmp, 10, &rate);
-    if (res != 0) {
-        printk(KERN_ERR "Sampling frequence must be a number.");
-        return -1;
-    }
-    if ((rate < 0) || (rate > MAXIMUM_RATE))
-    {
-        printk(KERN_ERR "Sampling frequence must in range [0..50], current is %ld", rate);
-        return -1;
-    }
-    sampl_frequence = rate;
-    raspi_update_timer();
-    // Start measurement
-    startMeasureDistance = true;
+    res = kstrtouint_from_user(buf, count, 10, &rate);
+    if (res)
+        return res;
 
-    printk(KERN_INFO "Sample frequence: %d", sampl_frequence);
-    return bytes_writen;
-}
+    mutex_lock(&config_lock);
+    cfg = config;
+    cfg.rate = rate;
+    res = apply_config(&cfg);
+    mutex_unlock(&config_lock);
 
+    return res ? res : count;
+}
 static int      raspi_gpio_release(struct inode *inode, struct file *filp) {
+    struct reader *r = filp->private_data;
+
+    if (!r->mapped)
+        atomic_dec(&ring_readers);
+    kfree(r);
     module_put(THIS_MODULE);
 
     return 0;
 }
+/*
+ * Control plane, see DUAL_HCSR04_IOC_* in dual_hcsr04.h.
+ */
+static long     raspi_gpio_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    void __user *argp = (void __user *)arg;
+    struct reader *r = filp->private_data;
+    struct dual_hcsr04_config cfg;
+    struct dual_hcsr04_counters counters;
+    struct dual_hcsr04_read req;
+    struct dual_hcsr04_latest latest;
+    u32 mode, cursor;
+    long ret;
+    int i;
+
+    switch (cmd) {
+    case DUAL_HCSR04_IOC_GET_CONFIG:
+        mutex_lock(&config_lock);
+        cfg = config;
+        mutex_unlock(&config_lock);
+        return copy_to_user(argp, &cfg, sizeof(cfg)) ? -EFAULT : 0;
+
+    case DUAL_HCSR04_IOC_SET_CONFIG:
+        if (copy_from_user(&cfg, argp, sizeof(cfg)))
+            return -EFAULT;
+        mutex_lock(&config_lock);
+        ret = apply_config(&cfg);
+        mutex_unlock(&config_lock);
+        return ret;
+
+    case DUAL_HCSR04_IOC_SET_MODE:
+        if (get_user(mode, (u32 __user *)argp))
+            return -EFAULT;
+        if (mode != DUAL_HCSR04_MODE_BINARY && mode != DUAL_HCSR04_MODE_TEXT &&
+            mode != DUAL_HCSR04_MODE_EDGES)
+            return -EINVAL;
+        WRITE_ONCE(r->mode, mode);
+        return 0;
+
+    case DUAL_HCSR04_IOC_GET_COUNTERS:
+        memset(&counters, 0, sizeof(counters));
+        counters.engine_wakeups = engine_wakeups;
+        counters.sched_overruns = sched_overruns;
+        counters.sched_jitter_max_ns = sched_jitter_max_ns;
+        counters.samples = samples_published;
+        counters.timeouts = echo_timeouts;
+        counters.glitches = echo_glitches;
+        for (i = 0; i < num_channels; i++)
+            counters.overflows += ring_overflows[i];
+        return copy_to_user(argp, &counters, sizeof(counters)) ? -EFAULT : 0;
+
+    case DUAL_HCSR04_IOC_READ:
+        if (copy_from_user(&req, argp, sizeof(req)))
+            return -EFAULT;
+        if (mutex_lock_interruptible(&read_lock))
+            return -ERESTARTSYS;
+        ret = read_records(u64_to_user_ptr(req.records),
+                           (size_t)req.count * sizeof(struct dual_hcsr04_record));
+        mutex_unlock(&read_lock);
+        if (ret < 0)
+            return ret;
+        req.filled = ret / sizeof(struct dual_hcsr04_record);
+        return put_user(req.filled, &((struct dual_hcsr04_read __user *)argp)->filled);
+
+    case DUAL_HCSR04_IOC_GET_LATEST:
+        memset(&latest, 0, sizeof(latest));
+        latest.channels = num_channels;
+        for (i = 0; i < num_channels; i++)
+            latest_read(i, &latest.records[i]);
+        return copy_to_user(argp, &latest, sizeof(latest)) ? -EFAULT : 0;
+
+    case DUAL_HCSR04_IOC_SET_CURSOR:
+        if (!READ_ONCE(r->mapped))
+            return -EINVAL;
+        if (get_user(cursor, (u32 __user *)argp))
+            return -EFAULT;
+        WRITE_ONCE(r->cursor, cursor);
+        // Samples before head may be unread again for a poll() of this file
+        wake_up_interruptible(&read_wait);
+        return 0;
+
+    default:
+        return -ENOTTY;
+    }
+}
+/*
+ * Readable as soon as any echo ring has unread samples, or in edge mode the
+ * capture ring has unread edges. A file that mapped the shared ring reads
+ * from there instead of the global echo rings, so it is readable while head
+ * differs from the cursor its consumer set. Nothing here changes state, so
+ * level triggered epoll and threads sharing the file see the same result.
+ */
+static unsigned int raspi_gpio_poll(struct file *filp, poll_table *wait) {
+    struct reader *r = filp->private_data;
+    u32 mode = READ_ONCE(r->mode);
+    unsigned int mask = 0;
+    u32 head;
+
+    poll_wait(filp, &read_wait, wait);
+    if (mode != DUAL_HCSR04_MODE_EDGES && READ_ONCE(r->mapped)) {
+        head = smp_load_acquire(&mmap_header->head);
+        if (head != READ_ONCE(r->cursor))
+            mask |= POLLIN | POLLRDNORM;
+    } else if (read_ready(mode)) {
+        mask |= POLLIN | POLLRDNORM;
+    }
+
+    return mask;
+}
+/*
+ * Map the shared sample ring, read only, starting at offset 0.
+ */
+static int      raspi_gpio_mmap(struct file *filp, struct vm_area_struct *vma) {
+    struct reader *r = filp->private_data;
+    int ret;
+
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > MMAP_AREA_SIZE)
+        return -EINVAL;
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    // vm_flags is read only from 6.3, changes go through the helpers
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    ret = remap_vmalloc_range(vma, mmap_area, 0);
+    if (ret)
+        return ret;
+    // poll() reports samples published from now on, like a new ring consumer
+    if (!READ_ONCE(r->mapped))
+        WRITE_ONCE(r->cursor, smp_load_acquire(&mmap_header->head));
+    // and the file stops reading the echo rings
+    if (!xchg(&r->mapped, true))
+        atomic_dec(&ring_readers);
+
+    return 0;
+}
+
+#if IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+/*
+ * IIO device: one distance channel per echo plus a timestamp. Raw values are
+ * the distance of the last sample in mm with DUAL_HCSR04_DISTANCE_SHIFT
+ * fractional bits, 0 if the echo timed out; the scale converts to metres.
+ */
+static int      raspi_iio_read_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+                                   int *val, int *val2, long mask) {
+    switch (mask) {
+    case IIO_CHAN_INFO_RAW:
+        *val = READ_ONCE(channels[chan->channel].latest);
+        return IIO_VAL_INT;
+    case IIO_CHAN_INFO_SCALE:
+        *val = 1;
+        *val2 = 1000 << DUAL_HCSR04_DISTANCE_SHIFT;
+        return IIO_VAL_FRACTIONAL;
+    default:
+        return -EINVAL;
+    }
+}
+/*
+ * Buffer a scan of the latest distances of the enabled echoes. Runs on every
+ * trigger: the device trigger fires once per engine pass that published
+ * samples, the hrtimer and sysfs triggers at their own pace.
+ */
+static irqreturn_t raspi_iio_trigger_handler(int irq, void *p)
+{
+    struct iio_poll_func *pf = p;
+    struct iio_dev *indio_dev = pf->indio_dev;
+    struct {
+        s32     distance[MAX_CHANNELS];
+        s64     timestamp __aligned(8);
+    } scan;
+    int i, n = 0;
+
+    memset(&scan, 0, sizeof(scan));
+    for_each_set_bit(i, indio_dev->active_scan_mask, num_channels)
+        scan.distance[n++] = READ_ONCE(channels[i].latest);
+    // Chained polls from the device trigger have no top half timestamp
+    iio_push_to_buffers_with_timestamp(indio_dev, &scan,
+                                       pf->timestamp ? pf->timestamp : iio_get_time_ns(indio_dev));
+    pf->timestamp = 0;
+    iio_trigger_notify_done(indio_dev->trig);
+
+    return IRQ_HANDLED;
+}
+static int      raspi_iio_setup(void) {
+    int ret, i;
+
+    for (i = 0; i < num_channels; i++) {
+        struct iio_chan_spec *chan = &iio_channels[i];
+
+        chan->type = IIO_DISTANCE;
+        chan->indexed = 1;
+        chan->channel = i;
+        chan->info_mask_separate = BIT(IIO_CHAN_INFO_RAW);
+        chan->info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE);
+        chan->scan_index = i;
+        chan->scan_type.sign = 's';
+        chan->scan_type.realbits = 32;
+        chan->scan_type.storagebits = 32;
+        chan->scan_type.endianness = IIO_CPU;
+    }
+    iio_channels[num_channels] = (struct iio_chan_spec)IIO_CHAN_SOFT_TIMESTAMP(num_channels);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+    raspi_iio_dev = iio_device_alloc(NULL, 0);
+#else
+    raspi_iio_dev = iio_device_alloc(0);
+#endif
+    if (!raspi_iio_dev)
+        return -ENOMEM;
+    raspi_iio_dev->name = DEVICE_NAME;
+    raspi_iio_dev->modes = INDIO_DIRECT_MODE;
+    raspi_iio_dev->channels = iio_channels;
+    raspi_iio_dev->num_channels = num_channels + 1;
+    raspi_iio_dev->info = &raspi_iio_info;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0)
+    iio_trig = iio_trigger_alloc(NULL, "%s-dev%d", DEVICE_NAME, raspi_iio_dev->id);
+#else
+    iio_trig = iio_trigger_alloc("%s-dev%d", DEVICE_NAME, raspi_iio_dev->id);
+#endif
+    if (!iio_trig) {
+        ret = -ENOMEM;
+        goto fail_trigger;
+    }
+    ret = iio_trigger_register(iio_trig);
+    if (ret)
+        goto fail_register_trigger;
+    // Stream every published sample unless another trigger is selected
+    raspi_iio_dev->trig = iio_trigger_get(iio_trig);
+
+    ret = iio_triggered_buffer_setup(raspi_iio_dev, iio_pollfunc_store_time, raspi_iio_trigger_handler, NULL);
+    if (ret)
+        goto fail_buffer;
+    ret = iio_device_register(raspi_iio_dev);
+    if (ret)
+        goto fail_device;
+
+    return 0;
+
+fail_device:
+    iio_triggered_buffer_cleanup(raspi_iio_dev);
+fail_buffer:
+    iio_trigger_unregister(iio_trig);
+fail_register_trigger:
+    iio_trigger_free(iio_trig);
+fail_trigger:
+    iio_device_free(raspi_iio_dev);
+
+    return ret;
+}
+static void     raspi_iio_cleanup(void) {
+    iio_device_unregister(raspi_iio_dev);
+    iio_triggered_buffer_cleanup(raspi_iio_dev);
+    iio_trigger_unregister(iio_trig);
+    iio_trigger_free(iio_trig);
+    iio_device_free(raspi_iio_dev);
+}
+/*
+ * Called by the engine thread, so the trigger's consumers run nested in it.
+ */
+static void     raspi_iio_poll(void) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    iio_trigger_poll_nested(iio_trig);
+#else
+    iio_trigger_poll_chained(iio_trig);
+#endif
+}
+#else
+/* Without IIO the character device and mmap ring are the only front ends */
+static int      raspi_iio_setup(void) {
+    return 0;
+}
+static void     raspi_iio_cleanup(void) {
+}
+static void     raspi_iio_poll(void) {
+}
+#endif
+
+/*
+ * debugfs: one file per echo with the summed statistics and the achieved
+ * rate since load or the last reset, and a write only reset file.
+ */
+static void     stats_show_hist(struct seq_file *m, const char *name, const unsigned long *hist) {
+    int i;
+
+    seq_printf(m, "%s:\n", name);
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        if (!hist[i])
+            continue;
+        if (i == 0)
+            seq_printf(m, "  %10u ns: %lu\n", 0, hist[i]);
+        else if (i == HIST_BUCKETS - 1)
+            seq_printf(m, "  %10lu+ ns: %lu\n", 1ul << (i - 1), hist[i]);
+        else
+            seq_printf(m, "  %10lu ns: %lu\n", 1ul << (i - 1), hist[i]);
+    }
+}
+static int      stats_show(struct seq_file *m, void *v) {
+    int index = (long)m->private;
+    struct channel_stats sum;
+    u64 elapsed = ktime_get_ns() - READ_ONCE(stats_reset_ns);
+    int cpu, i;
+
+    memset(&sum, 0, sizeof(sum));
+    for_each_possible_cpu(cpu) {
+        // struct channel_stats is all unsigned long
+        const unsigned long *src = (const unsigned long *)per_cpu_ptr(&stats->ch[index], cpu);
+        unsigned long *dst = (unsigned long *)&sum;
+
+        for (i = 0; i < sizeof(sum) / sizeof(*dst); i++)
+            dst[i] += src[i];
+    }
+
+    seq_printf(m, "samples: %lu\n", sum.samples);
+    seq_printf(m, "timeouts: %lu\n", sum.timeouts);
+    seq_printf(m, "glitches: %lu\n", sum.glitches);
+    seq_printf(m, "overflows: %lu\n", sum.overflows);
+    seq_printf(m, "rate: %llu\n", elapsed ? div64_u64((u64)sum.samples * NSEC_PER_SEC, elapsed) : 0);
+    stats_show_hist(m, "latency", sum.latency_hist);
+    stats_show_hist(m, "width", sum.width_hist);
+    stats_show_hist(m, "cycle", sum.cycle_hist);
+
+    return 0;
+}
+static int      stats_open(struct inode *inode, struct file *filp) {
+    return single_open(filp, stats_show, inode->i_private);
+}
+static ssize_t  stats_reset_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(stats, cpu), 0, sizeof(struct engine_stats));
+    WRITE_ONCE(stats_reset_ns, ktime_get_ns());
+
+    return count;
+}
+static const struct file_operations stats_fops = {
+                                                    .owner = THIS_MODULE,
+                                                    .open = stats_open,
+                                                    .read = seq_read,
+                                                    .llseek = seq_lseek,
+                                                    .release = single_release,
+                                                };
+static const struct file_operations stats_reset_fops = {
+                                                    .owner = THIS_MODULE,
+                                                    .write = stats_reset_write,
+                                                };
+/*
+ * Statistics are optional, errors only leave them out.
+ */
+static void     stats_debugfs_init(void) {
+    char name[8];
+    int i;
+
+    debugfs_dir = debugfs_create_dir(DEVICE_NAME, NULL);
+    if (IS_ERR_OR_NULL(debugfs_dir))
+        return;
+    for (i = 0; i < num_channels; i++) {
+        snprintf(name, sizeof(name), "echo%d", i + 1);
+        debugfs_create_file(name, 0444, debugfs_dir, (void *)(long)i, &stats_fops);
+    }
+    debugfs_create_file("reset", 0200, debugfs_dir, NULL, &stats_reset_fops);
+}
+
+/*
+ * hrtimer_setup() replaces hrtimer_init() and setting ->function from 6.13 on.
+ */
+static void     raspi_hrtimer_setup(struct hrtimer *timer,
+                                    enum hrtimer_restart (*function)(struct hrtimer *),
+                                    clockid_t clock_id, enum hrtimer_mode mode) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(timer, function, clock_id, mode);
+#else
+    hrtimer_init(timer, clock_id, mode);
+    timer->function = function;
+#endif
+}
 
 /*
  * Module init function
@@ -294,95 +1568,171 @@ static int __init gpiomode_init(void)
 {
     int ret = 0;
     int tmp;
+    int i;
 
     // Init all flags
-    startMeasureDistance = false;
-    echo1Finished = false;
-    echo2Finished = false;
+    engine_flags = 0;
+    set_sound_speed(config_sound_speed(&config));
+    echo_timeout_us = range_to_timeout_us(config.max_range_mm, sound_speed);
+    max_rate = config_max_rate(&config, echo_timeout_us);
 
     printk(KERN_INFO "%s\n", __func__);
 
-    // register trigger pin
-    ret = gpio_request_array(triggers, ARRAY_SIZE(triggers));
+    // allocate the shared sample ring
+    mmap_area = vmalloc_user(MMAP_AREA_SIZE);
+    if (!mmap_area) {
+        printk(KERN_ERR "Unable to allocate the shared sample ring\n");
+        return -ENOMEM;
+    }
+    mmap_header = mmap_area;
+    mmap_ring = mmap_area + PAGE_SIZE;
+    mmap_head = 0;
+    mmap_header->magic = DUAL_HCSR04_MMAP_MAGIC;
+    mmap_header->version = DUAL_HCSR04_MMAP_VERSION;
+    mmap_header->ring_size = MMAP_RING_SIZE;
+    mmap_header->data_offset = PAGE_SIZE;
+    mmap_header->head = 0;
+    mmap_header->channels = num_channels;
+
+    // allocate the statistics
+    stats = alloc_percpu(struct engine_stats);
+    if (!stats) {
+        printk(KERN_ERR "Unable to allocate the statistics\n");
+        ret = -ENOMEM;
+        goto fail0;
+    }
+    stats_reset_ns = ktime_get_ns();
+
+    // register trigger pins
+    for (i = 0; i < num_groups; i++) {
+        struct trigger_group *grp = &groups[i];
+
+        grp->trigger = trigger_gpios[i];
+        group_sched[i].crosstalk_mask = (group_crosstalk[i] | BIT(i)) & (BIT(num_groups) - 1);
+        snprintf(grp->label, sizeof(grp->label), "Trigger %d", i + 1);
+        triggers[i].gpio = grp->trigger;
+        triggers[i].flags = GPIOF_OUT_INIT_LOW;
+        triggers[i].label = grp->label;
+        raspi_hrtimer_setup(&grp->timeout, echo_timeout, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    }
+    // Hearing goes both ways: if group o hears g, g must not fire while o does
+    for (i = 0; i < num_groups; i++) {
+        int o;
+
+        for (o = 0; o < num_groups; o++) {
+            if (group_sched[o].crosstalk_mask & BIT(i))
+                group_sched[i].crosstalk_mask |= BIT(o);
+        }
+    }
+    ret = gpio_request_array(triggers, num_groups);
 
     if (ret) {
         printk(KERN_ERR "Unable to request GPIOs for triggers: %d\n", ret);
-        return ret;
+        goto fail0;
     }
 
     // register ECHO gpios
-    ret = gpio_request_array(echos, ARRAY_SIZE(echos));
+    for (i = 0; i < num_channels; i++) {
+        if (echo_groups[i] < 0 || echo_groups[i] >= num_groups) {
+            printk(KERN_ERR "Echo %d has no trigger group %d\n", i + 1, echo_groups[i]);
+            ret = -EINVAL;
+            goto fail1;
+        }
+        channels[i].index = i;
+        channels[i].group = echo_groups[i];
+        groups[echo_groups[i]].channel_mask |= BIT(i);
+        snprintf(channels[i].label, sizeof(channels[i].label), "Echo %d", i + 1);
+        echos[i].gpio = echo_gpios[i];
+        echos[i].flags = GPIOF_IN;
+        echos[i].label = channels[i].label;
+    }
+    ret = gpio_request_array(echos, num_channels);
 
     if (ret) {
         printk(KERN_ERR "Unable to request GPIOs for echos: %d\n", ret);
         goto fail1;
     }
 
-    printk(KERN_INFO "Current button1 value: %d\n", gpio_get_value(echos[0].gpio));
-
-    ret = gpio_to_irq(echos[0].gpio);
+    for (i = 0; i < num_channels; i++) {
+        struct echo_channel *ch = &channels[i];
 
-    if(ret < 0) {
-        printk(KERN_ERR "Unable to request IRQ: %d\n", ret);
-        goto fail2;
-    }
+        ch->high = gpio_get_value(echos[i].gpio);
+        snprintf(ch->name, sizeof(ch->name), "dual_hcsr04#echo%d", i + 1);
 
-    echo_irqs[0] = ret;
+        ret = gpio_to_irq(echos[i].gpio);
 
-    printk(KERN_INFO "Successfully requested BUTTON1 IRQ # %d\n", echo_irqs[0]);
-
-    ret = request_irq(echo_irqs[0], echo_isr, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "dual_hcsr04#echo1", NULL);
+        if(ret < 0) {
+            printk(KERN_ERR "Unable to request IRQ: %d\n", ret);
+            goto fail3;
+        }
 
-    if(ret) {
-        printk(KERN_ERR "Unable to request IRQ: %d\n", ret);
-        goto fail2;
-    }
+        ch->irq = ret;
 
+        printk(KERN_INFO "Successfully requested ECHO%d IRQ # %d\n", i + 1, ch->irq);
 
-    ret = gpio_to_irq(echos[1].gpio);
+        ret = request_irq(ch->irq, echo_isr, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, ch->name, ch);
 
-    if(ret < 0) {
-        printk(KERN_ERR "Unable to request IRQ: %d\n", ret);
-        goto fail2;
+        if(ret) {
+            printk(KERN_ERR "Unable to request IRQ: %d\n", ret);
+            goto fail3;
+        }
     }
 
-    echo_irqs[1] = ret;
-
-    printk(KERN_INFO "Successfully requested BUTTON2 IRQ # %d\n", echo_irqs[1]);
-
-    ret = request_irq(echo_irqs[1], echo_isr, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "dual_hcsr04#echo2", NULL);
+    /* Initialize timer for scheduling */
+    raspi_hrtimer_setup(&schedule_timer, measure_timer_function, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    raspi_hrtimer_setup(&gap_timer, gap_timer_function, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
 
-    if(ret) {
-        printk(KERN_ERR "Unable to request IRQ: %d\n", ret);
+    /* Register the IIO device, the engine triggers its buffer */
+    ret = raspi_iio_setup();
+    if (ret) {
+        printk(KERN_ERR "Unable to register the IIO device: %d\n", ret);
         goto fail3;
     }
 
-    /* Request character device */
+    /* Create and start the distance measuring thread */
+    runThreads[0] = kthread_run(&get_distance_thread,(void *)NULL,"distance");
+    if (IS_ERR(runThreads[0])) {
+        printk(KERN_ERR "Unable to start the distance thread\n");
+        ret = PTR_ERR(runThreads[0]);
+        goto fail5;
+    }
+
+    /* Request character device, last so no file op runs before the engine is ready */
     tmp = register_chrdev(DEVICE_MAJOR, DEVICE_NAME, &raspi_gpio_fops);
     if (tmp < 0) {
         printk(KERN_ERR "Unable to register char device with major %d and name %s.", DEVICE_MAJOR, DEVICE_NAME);
-        goto fail3;
+        ret = tmp;
+        goto fail4;
     }
     printk(KERN_INFO "Successfully registered char device %d - %s", DEVICE_MAJOR, DEVICE_NAME);
 
-    /* Initialize timer for scheduling */
-    init_timer(&schedule_timer);
-    init_timer(&distanceTimeoutTimer);
-
-    /* Create and start the distance measuring thread */
-    runThreads[0] = kthread_run(&get_distance_thread,(void *)NULL,"distance");
+    stats_debugfs_init();
 
     return 0;
 
 // cleanup what has been setup so far
+fail4:
+    kthread_stop(runThreads[0]);
+    hrtimer_cancel(&gap_timer);
+    for (i = 0; i < num_groups; i++)
+        hrtimer_cancel(&groups[i].timeout);
+
+fail5:
+    raspi_iio_cleanup();
+    i = num_channels;
+
 fail3:
-    free_irq(echo_irqs[0], NULL);
+    while (--i >= 0)
+        free_irq(channels[i].irq, &channels[i]);
 
-fail2:
-    gpio_free_array(echos, ARRAY_SIZE(triggers));
+    gpio_free_array(echos, num_channels);
 
 fail1:
-    gpio_free_array(triggers, ARRAY_SIZE(triggers));
+    gpio_free_array(triggers, num_groups);
+
+fail0:
+    free_percpu(stats);
+    vfree(mmap_area);
 
     return ret;
 }
@@ -396,29 +1746,38 @@ static void __exit gpiomode_exit(void)
 
     printk(KERN_INFO "%s\n", __func__);
 
+    debugfs_remove_recursive(debugfs_dir);
+
     // Un-register char device
     unregister_chrdev(DEVICE_MAJOR, DEVICE_NAME);
 
-    del_timer_sync(&schedule_timer);
-    del_timer_sync(&distanceTimeoutTimer);
-
     // stop threads
-    threadStops[0] = true;
-    threadStops[1] = true;
     kthread_stop(runThreads[0]);
 
+    hrtimer_cancel(&schedule_timer);
+    hrtimer_cancel(&gap_timer);
+    for(i = 0; i < num_groups; i++) {
+        hrtimer_cancel(&groups[i].timeout);
+    }
+
+    raspi_iio_cleanup();
+
     // free irqs
-    free_irq(echo_irqs[0], NULL);
-    free_irq(echo_irqs[1], NULL);
+    for(i = 0; i < num_channels; i++) {
+        free_irq(channels[i].irq, &channels[i]);
+    }
 
     // turn all triggers off
-    for(i = 0; i < ARRAY_SIZE(triggers); i++) {
+    for(i = 0; i < num_groups; i++) {
         gpio_set_value(triggers[i].gpio, 0);
     }
 
     // unregister
-    gpio_free_array(triggers, ARRAY_SIZE(triggers));
-    gpio_free_array(echos, ARRAY_SIZE(echos));
+    gpio_free_array(triggers, num_groups);
+    gpio_free_array(echos, num_channels);
+
+    free_percpu(stats);
+    vfree(mmap_area);
 }
 
 MODULE_LICENSE("GPL");
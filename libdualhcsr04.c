@@ -0,0 +1,284 @@
+/*
+ * Dual Untrasonic HC-SR04 controller driver - userspace client library.
+ *
+ * Author:
+ *  Linh Nguyen (nvl1109@gmail.com)
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "libdualhcsr04.h"
+
+/*
+ * @fd: device file, binary mode, non-blocking
+ * @flags: DUALHCSR04_* open flags
+ * @channels: number of echo channels
+ * @area: mapping of the shared ring, NULL if not mapped
+ * @size: size of area
+ * @hdr: ring header in area
+ * @ring: ring slots in area
+ * @mask: ring_size - 1
+ * @cursor: next ring sample to read
+ * @acked: cursor last passed to DUAL_HCSR04_IOC_SET_CURSOR, poll() reports
+ *         samples from there on
+ * @lost: ring samples overwritten before they were read
+ * @gap: flag the next sample read with DUAL_HCSR04_FLAG_OVERFLOW
+ */
+struct dualhcsr04 {
+    int         fd;
+    unsigned int flags;
+    unsigned int channels;
+    void        *area;
+    size_t      size;
+    const volatile struct dual_hcsr04_mmap_header *hdr;
+    const volatile struct dual_hcsr04_record *ring;
+    __u32       mask;
+    __u32       cursor;
+    __u32       acked;
+    unsigned long long lost;
+    int         gap;
+};
+
+/* Map the shared ring, the header first to learn its geometry */
+static int map_ring(struct dualhcsr04 *dev)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    const struct dual_hcsr04_mmap_header *hdr;
+    void *area;
+
+    area = mmap(NULL, page, PROT_READ, MAP_SHARED, dev->fd, 0);
+    if (area == MAP_FAILED)
+        return -errno;
+    hdr = area;
+    if (hdr->magic != DUAL_HCSR04_MMAP_MAGIC || hdr->version != DUAL_HCSR04_MMAP_VERSION) {
+        munmap(area, page);
+        return -EPROTO;
+    }
+    dev->size = hdr->data_offset + hdr->ring_size * sizeof(struct dual_hcsr04_record);
+    munmap(area, page);
+
+    area = mmap(NULL, dev->size, PROT_READ, MAP_SHARED, dev->fd, 0);
+    if (area == MAP_FAILED)
+        return -errno;
+    dev->area = area;
+    dev->hdr = area;
+    dev->ring = (const void *)((const char *)area + dev->hdr->data_offset);
+    dev->mask = dev->hdr->ring_size - 1;
+    dev->channels = dev->hdr->channels;
+    /* Start with the samples published from now on */
+    dev->cursor = __atomic_load_n(&dev->hdr->head, __ATOMIC_ACQUIRE);
+    dev->acked = dev->cursor;
+    if (ioctl(dev->fd, DUAL_HCSR04_IOC_SET_CURSOR, &dev->cursor)) {
+        munmap(area, dev->size);
+        dev->area = NULL;
+        return -errno;
+    }
+    return 0;
+}
+
+/*
+ * Tell the driver how far the ring is read, so poll() stops reporting the
+ * samples. Only needed once the ring looks drained.
+ */
+static int ack_ring(struct dualhcsr04 *dev)
+{
+    if (dev->acked == dev->cursor)
+        return 0;
+    if (ioctl(dev->fd, DUAL_HCSR04_IOC_SET_CURSOR, &dev->cursor))
+        return -errno;
+    dev->acked = dev->cursor;
+    return 0;
+}
+
+struct dualhcsr04 *dualhcsr04_open(const char *path, unsigned int flags)
+{
+    struct dual_hcsr04_latest latest;
+    struct dualhcsr04 *dev;
+    __u32 mode = DUAL_HCSR04_MODE_BINARY;
+    int err;
+
+    dev = calloc(1, sizeof(*dev));
+    if (!dev)
+        return NULL;
+    dev->flags = flags;
+    dev->fd = open(path ? path : DUALHCSR04_DEVICE_PATH, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (dev->fd < 0)
+        goto fail;
+    /* Newly opened files may start in text mode, see text_mode */
+    if (ioctl(dev->fd, DUAL_HCSR04_IOC_SET_MODE, &mode))
+        goto fail;
+
+    if (!(flags & DUALHCSR04_NO_MMAP) && !map_ring(dev))
+        return dev;
+    if (ioctl(dev->fd, DUAL_HCSR04_IOC_GET_LATEST, &latest))
+        goto fail;
+    dev->channels = latest.channels;
+    return dev;
+
+fail:
+    err = errno;
+    if (dev->fd >= 0)
+        close(dev->fd);
+    free(dev);
+    errno = err;
+    return NULL;
+}
+
+void dualhcsr04_close(struct dualhcsr04 *dev)
+{
+    if (!dev)
+        return;
+    if (dev->area)
+        munmap(dev->area, dev->size);
+    close(dev->fd);
+    free(dev);
+}
+
+int dualhcsr04_fd(const struct dualhcsr04 *dev)
+{
+    return dev->fd;
+}
+
+int dualhcsr04_mapped(const struct dualhcsr04 *dev)
+{
+    return dev->area != NULL;
+}
+
+unsigned int dualhcsr04_channels(const struct dualhcsr04 *dev)
+{
+    return dev->channels;
+}
+
+unsigned long long dualhcsr04_lost(const struct dualhcsr04 *dev)
+{
+    return dev->lost;
+}
+
+/* Copy up to count samples from the mmap ring */
+static unsigned int read_ring(struct dualhcsr04 *dev, struct dual_hcsr04_record *recs,
+                              unsigned int count)
+{
+    __u32 size = dev->mask + 1;
+    __u32 head = __atomic_load_n(&dev->hdr->head, __ATOMIC_ACQUIRE);
+    unsigned int n = 0;
+
+    if (head - dev->cursor > size) {
+        /* Lapped by the producer, skip to the oldest valid slot */
+        dev->lost += head - dev->cursor - size;
+        dev->cursor = head - size;
+        dev->gap = 1;
+    }
+    while (n < count && dev->cursor != head) {
+        recs[n] = *(const struct dual_hcsr04_record *)&dev->ring[dev->cursor & dev->mask];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&dev->hdr->head, __ATOMIC_ACQUIRE);
+        dev->cursor++;
+        if (head - (dev->cursor - 1) >= size) {
+            /* Slot may have been overwritten while copying it */
+            dev->lost++;
+            dev->gap = 1;
+            continue;
+        }
+        if (dev->gap) {
+            recs[n].flags |= DUAL_HCSR04_FLAG_OVERFLOW;
+            dev->gap = 0;
+        }
+        n++;
+    }
+    return n;
+}
+
+int dualhcsr04_read(struct dualhcsr04 *dev, struct dual_hcsr04_record *recs, unsigned int count)
+{
+    struct dual_hcsr04_read req;
+    unsigned int n;
+    ssize_t len;
+
+    if (dev->area) {
+        n = read_ring(dev, recs, count);
+        return n ? (int)n : ack_ring(dev);
+    }
+    if (dev->flags & DUALHCSR04_IOCTL_READ) {
+        req.records = (__u64)(uintptr_t)recs;
+        req.count = count;
+        req.filled = 0;
+        if (ioctl(dev->fd, DUAL_HCSR04_IOC_READ, &req))
+            return -errno;
+        return req.filled;
+    }
+    len = read(dev->fd, recs, (size_t)count * sizeof(*recs));
+    if (len < 0)
+        return errno == EAGAIN ? 0 : -errno;
+    return len / sizeof(*recs);
+}
+
+int dualhcsr04_wait(struct dualhcsr04 *dev, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+    int ret;
+
+    /* poll() of a mapped file reports samples from the last acked cursor on */
+    if (dev->area) {
+        if (__atomic_load_n(&dev->hdr->head, __ATOMIC_ACQUIRE) != dev->cursor)
+            return 1;
+        ret = ack_ring(dev);
+        if (ret)
+            return ret;
+    }
+    ret = poll(&pfd, 1, timeout_ms);
+    if (ret < 0)
+        return -errno;
+    return ret > 0;
+}
+
+/* Copy the last sample of an echo, retrying while the driver updates it */
+static void read_latest(const volatile struct dual_hcsr04_latest_slot *slot,
+                        struct dual_hcsr04_record *rec)
+{
+    __u32 seq;
+
+    for (;;) {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        *rec = *(const struct dual_hcsr04_record *)&slot->record;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+            return;
+    }
+}
+
+int dualhcsr04_latest(struct dualhcsr04 *dev, unsigned int channel, struct dual_hcsr04_record *rec)
+{
+    struct dual_hcsr04_latest latest;
+
+    if (channel < 1 || channel > dev->channels)
+        return -EINVAL;
+    if (dev->area) {
+        read_latest(&dev->hdr->latest[channel - 1], rec);
+        return 0;
+    }
+    if (ioctl(dev->fd, DUAL_HCSR04_IOC_GET_LATEST, &latest))
+        return -errno;
+    *rec = latest.records[channel - 1];
+    return 0;
+}
+
+int dualhcsr04_get_config(struct dualhcsr04 *dev, struct dual_hcsr04_config *cfg)
+{
+    return ioctl(dev->fd, DUAL_HCSR04_IOC_GET_CONFIG, cfg) ? -errno : 0;
+}
+
+int dualhcsr04_set_config(struct dualhcsr04 *dev, const struct dual_hcsr04_config *cfg)
+{
+    return ioctl(dev->fd, DUAL_HCSR04_IOC_SET_CONFIG, cfg) ? -errno : 0;
+}
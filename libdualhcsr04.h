@@ -0,0 +1,86 @@
+/*
+ * Dual Untrasonic HC-SR04 controller driver - userspace client library.
+ *
+ * Wraps /dev/dual_hcsr04 so consumers do not have to hand-roll the read,
+ * mmap and ioctl protocols of dual_hcsr04.h. By default samples are copied
+ * from the shared mmap ring, without a syscall per batch, and a mapped handle
+ * never touches the driver's read() rings. All calls return a negative errno
+ * on failure.
+ *
+ * A handle is not thread safe, use one per thread.
+ *
+ * Author:
+ *  Linh Nguyen (nvl1109@gmail.com)
+ *
+ */
+
+#ifndef _LIBDUALHCSR04_H
+#define _LIBDUALHCSR04_H
+
+#include "dual_hcsr04.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DUALHCSR04_DEVICE_PATH  "/dev/dual_hcsr04"
+
+/* dualhcsr04_open() flags */
+#define DUALHCSR04_NO_MMAP      (1 << 0)    /* read with read(), not from the mmap ring */
+#define DUALHCSR04_IOCTL_READ   (1 << 1)    /* with DUALHCSR04_NO_MMAP, use DUAL_HCSR04_IOC_READ */
+
+struct dualhcsr04;
+
+/*
+ * Open the device, NULL for DUALHCSR04_DEVICE_PATH. Falls back to read() if
+ * the ring cannot be mapped. Returns NULL with errno set on failure.
+ */
+struct dualhcsr04 *dualhcsr04_open(const char *path, unsigned int flags);
+void dualhcsr04_close(struct dualhcsr04 *dev);
+
+/*
+ * File descriptor to add to poll()/epoll() for POLLIN; once it is readable,
+ * call dualhcsr04_read() until it returns 0. For a mapped handle that also
+ * tells the driver the ring is read, so the descriptor stops being readable.
+ * The descriptor is non-blocking.
+ */
+int dualhcsr04_fd(const struct dualhcsr04 *dev);
+
+/* Non-zero if samples come from the mmap ring */
+int dualhcsr04_mapped(const struct dualhcsr04 *dev);
+
+/* Number of echo channels */
+unsigned int dualhcsr04_channels(const struct dualhcsr04 *dev);
+
+/*
+ * Copy up to count samples, oldest first, into recs. Never blocks, returns
+ * the number of samples, 0 if there is none.
+ */
+int dualhcsr04_read(struct dualhcsr04 *dev, struct dual_hcsr04_record *recs, unsigned int count);
+
+/*
+ * Wait up to timeout_ms (-1 forever) for samples. Returns 1 if there are
+ * samples, 0 on timeout.
+ */
+int dualhcsr04_wait(struct dualhcsr04 *dev, int timeout_ms);
+
+/*
+ * Last sample of an echo (from 1), without consuming it. A zero record if
+ * the echo has no sample yet.
+ */
+int dualhcsr04_latest(struct dualhcsr04 *dev, unsigned int channel, struct dual_hcsr04_record *rec);
+
+/*
+ * Samples of the mmap ring that were overwritten before they were read, in
+ * total. The next sample after a gap has DUAL_HCSR04_FLAG_OVERFLOW set.
+ */
+unsigned long long dualhcsr04_lost(const struct dualhcsr04 *dev);
+
+int dualhcsr04_get_config(struct dualhcsr04 *dev, struct dual_hcsr04_config *cfg);
+int dualhcsr04_set_config(struct dualhcsr04 *dev, const struct dual_hcsr04_config *cfg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LIBDUALHCSR04_H */